@@ -1,13 +1,23 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
+// The buffer cache is a hash table of buf structures holding
 // cached copies of disk block contents.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
+// Each hash bucket has its own lock, so lookups of blocks in
+// different buckets don't contend. Eviction picks the unused
+// buffer with the oldest lastuse timestamp.
+//
 // Interface:
 // * To get a buffer for a particular disk block, call bread.
 // * After changing buffer data, call bwrite to write it to disk.
+// * To write several buffers at once, call bawrite on each,
+//     or bawritev on all of them, then bwait on each.
+// * To start reading blocks that will be needed soon,
+//     call bprefetch or bprefetchv.
+// * Disk requests go through the I/O scheduler (iosched.c),
+//     which orders them and merges runs of consecutive blocks.
 // * When done with the buffer, call brelse.
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
@@ -23,14 +33,19 @@
 #include "fs.h"
 #include "buf.h"
 
-struct {
+#define NBUCKET 13
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
+
+struct bucket {
   struct spinlock lock;
-  struct buf buf[NBUF];
+  struct buf *head;
+};
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+struct {
+  struct spinlock lock;  // serializes eviction
+  int nwait;             // processes looking for a free buffer
+  struct buf buf[NBUF];
+  struct bucket bucket[NBUCKET];
 } bcache;
 
 void
@@ -39,53 +54,146 @@ binit(void)
   struct buf *b;
 
   initlock(&bcache.lock, "bcache");
+  for(int i = 0; i < NBUCKET; i++)
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // All buffers start out holding block 0 of device 0.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->next = bcache.bucket[BHASH(0, 0)].head;
+    bcache.bucket[BHASH(0, 0)].head = b;
   }
 }
 
+// Look for block on device dev in bucket bkt.
+// Caller must hold bkt->lock.
+static struct buf*
+bfind(struct bucket *bkt, uint dev, uint blockno)
+{
+  struct buf *b;
+
+  for(b = bkt->head; b != 0; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      return b;
+  }
+  return 0;
+}
+
+// Recycle the least recently used (LRU) unused buffer to
+// hold block blockno of dev, and put it in bucket bkt.
+// The buffer is returned unlocked, with refcnt 1, or 0 if
+// every buffer is in use. Buffers that a prefetch is still
+// reading into (b->disk) don't count as unused.
+// Caller must hold bcache.lock.
+static struct buf*
+brecycle(struct bucket *bkt, uint dev, uint blockno)
+{
+  struct bucket *victim;
+  struct buf *b, *best, **pp;
+
+  // Keep holding the lock of the bucket that contains the
+  // best candidate so far, so that it can't be taken.
+  best = 0;
+  victim = 0;
+  for(struct bucket *bp = bcache.bucket; bp < bcache.bucket+NBUCKET; bp++){
+    int found = 0;
+    acquire(&bp->lock);
+    for(b = bp->head; b != 0; b = b->next){
+      if(b->refcnt == 0 && !b->disk && (best == 0 || b->lastuse < best->lastuse)){
+        best = b;
+        found = 1;
+      }
+    }
+    if(found){
+      if(victim)
+        release(&victim->lock);
+      victim = bp;
+    } else {
+      release(&bp->lock);
+    }
+  }
+  if(best == 0)
+    return 0;
+
+  // Move it to this block's bucket.
+  if(victim != bkt){
+    for(pp = &victim->head; *pp != best; pp = &(*pp)->next)
+      ;
+    *pp = best->next;
+    release(&victim->lock);
+    acquire(&bkt->lock);
+    best->next = bkt->head;
+    bkt->head = best;
+  }
+  best->dev = dev;
+  best->blockno = blockno;
+  best->valid = 0;
+  best->refcnt = 1;
+  release(&bkt->lock);
+  return best;
+}
+
 // Look through buffer cache for block on device dev.
 // If not found, allocate a buffer.
 // In either case, return locked buffer.
 static struct buf*
 bget(uint dev, uint blockno)
 {
+  struct bucket *bkt = &bcache.bucket[BHASH(dev, blockno)];
   struct buf *b;
+  int flushed = 0;
 
-  acquire(&bcache.lock);
+again:
+  acquire(&bkt->lock);
 
   // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
-    if(b->dev == dev && b->blockno == blockno){
-      b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
-    }
+  if((b = bfind(bkt, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bkt->lock);
+    acquiresleep(&b->lock);
+    return b;
   }
+  release(&bkt->lock);
 
-  // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
+  // Not cached. Only one process at a time may evict, so
+  // no one else can insert this block while we look.
+  acquire(&bcache.lock);
+  acquire(&bkt->lock);
+  if((b = bfind(bkt, dev, blockno)) != 0){
+    b->refcnt++;
+    release(&bkt->lock);
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    return b;
+  }
+  release(&bkt->lock);
+
+  // nwait is raised first, so that a buffer released
+  // after brecycle has looked at its bucket wakes us up.
+  bcache.nwait++;
+  if((b = brecycle(bkt, dev, blockno)) == 0){
+    // every buffer is in use. committed blocks waiting to
+    // be written home keep their buffers pinned, so have
+    // them flushed; if that isn't enough, wait for a buffer
+    // to be released. then look again, since someone may
+    // have cached the block meanwhile.
+    if(!flushed){
+      bcache.nwait--;
       release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+      log_flush();
+      flushed = 1;
+      goto again;
     }
+    sleep(&bcache, &bcache.lock);
+    bcache.nwait--;
+    release(&bcache.lock);
+    flushed = 0;
+    goto again;
   }
-  panic("bget: no buffers");
+  bcache.nwait--;
+  release(&bcache.lock);
+  acquiresleep(&b->lock);
+  return b;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -95,59 +203,193 @@ bread(uint dev, uint blockno)
   struct buf *b;
 
   b = bget(dev, blockno);
+  if(b->disk)
+    iowait(b);  // a prefetch is still reading it
   if(!b->valid) {
-    virtio_disk_rw(b, 0);
+    iosubmit(&b, 1, 0);
+    iowait(b);
     b->valid = 1;
   }
   return b;
 }
 
+// Return a new, unlocked buffer for block blockno of dev,
+// for a prefetch, or 0 if the block is already cached or
+// every buffer is in use.
+static struct buf*
+bnew(uint dev, uint blockno)
+{
+  struct bucket *bkt = &bcache.bucket[BHASH(dev, blockno)];
+  struct buf *b;
+
+  acquire(&bkt->lock);
+  b = bfind(bkt, dev, blockno);
+  release(&bkt->lock);
+  if(b)
+    return 0;
+
+  acquire(&bcache.lock);
+  acquire(&bkt->lock);
+  b = bfind(bkt, dev, blockno);
+  release(&bkt->lock);
+  if(b){
+    release(&bcache.lock);
+    return 0;
+  }
+  b = brecycle(bkt, dev, blockno);
+  release(&bcache.lock);
+  return b;
+}
+
+// Start reading the n buffers in bs, then let go of them.
+// Once the locks are released, b->disk keeps each from being
+// recycled and makes bread wait for the data.
+static void
+bstartread(struct buf **bs, int n)
+{
+  iosubmit(bs, n, 0);
+  for(int i = 0; i < n; i++)
+    brelse(bs[i]);
+}
+
+// Start reading the n blocks of dev listed in blocks into
+// the cache and return without waiting for them. Blocks
+// that are already cached are skipped, as are the rest if
+// every buffer is in use. The I/O scheduler merges runs of
+// consecutive blocks into single disk requests.
+void
+bprefetchv(uint dev, uint *blocks, int n)
+{
+  struct buf *run[MAXRUN];
+  struct buf *b;
+  int k = 0;
+
+  for(int i = 0; i < n; i++){
+    if((b = bnew(dev, blocks[i])) == 0)
+      continue;
+    if(k == MAXRUN){
+      bstartread(run, k);
+      k = 0;
+    }
+    // no one else has the new buffer yet, so this
+    // doesn't sleep.
+    acquiresleep(&b->lock);
+    b->valid = 1;
+    run[k++] = b;
+  }
+  if(k > 0)
+    bstartread(run, k);
+}
+
+// Start reading a block into the cache and return
+// without waiting for it.
+void
+bprefetch(uint dev, uint blockno)
+{
+  bprefetchv(dev, &blockno, 1);
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
 {
   if(!holdingsleep(&b->lock))
     panic("bwrite");
-  virtio_disk_rw(b, 1);
+  iosubmit(&b, 1, 1);
+  iowait(b);
+}
+
+// Start writing b's contents to disk and return without
+// waiting. b must stay locked until bwait(b) returns.
+void
+bawrite(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bawrite");
+  iosubmit(&b, 1, 1);
+}
+
+// Start writing the n buffers in bs to disk, and return
+// without waiting. The I/O scheduler merges runs of
+// consecutive blocks into single disk requests. Each buffer
+// must stay locked until bwait() on it returns.
+void
+bawritev(struct buf **bs, int n)
+{
+  for(int i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bawritev");
+  iosubmit(bs, n, 1);
+}
+
+// Wait for an earlier bawrite() of b to finish.
+void
+bwait(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwait");
+  iowait(b);
+}
+
+// A buffer may have become free to recycle: it is
+// unused, or a prefetch has finished reading into it.
+// Wake up processes waiting in bget for one.
+void
+bwakeup(void)
+{
+  if(bcache.nwait == 0)
+    return;
+  acquire(&bcache.lock);
+  wakeup(&bcache);
+  release(&bcache.lock);
 }
 
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// Record when it became unused, for LRU eviction.
 void
 brelse(struct buf *b)
 {
+  struct bucket *bkt;
+  int idle;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  bkt = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  acquire(&bkt->lock);
   b->refcnt--;
-  if (b->refcnt == 0) {
+  if ((idle = (b->refcnt == 0))) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    b->lastuse = ticks;
   }
-  
-  release(&bcache.lock);
+  release(&bkt->lock);
+  if(idle)
+    bwakeup();
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bkt = &bcache.bucket[BHASH(b->dev, b->blockno)];
+
+  acquire(&bkt->lock);
   b->refcnt++;
-  release(&bcache.lock);
+  release(&bkt->lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  struct bucket *bkt = &bcache.bucket[BHASH(b->dev, b->blockno)];
+  int idle;
+
+  acquire(&bkt->lock);
   b->refcnt--;
-  release(&bcache.lock);
+  if((idle = (b->refcnt == 0)))
+    b->lastuse = ticks;
+  release(&bkt->lock);
+  if(idle)
+    bwakeup();
 }
 
 
@@ -1,12 +1,17 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int dirty;   // log copy committed but not yet home?
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
-  struct buf *next;
+  uint lastuse;     // ticks when refcnt last dropped to 0, for LRU
+  struct buf *next; // hash bucket chain
+  int write;        // queued or in-flight request is a write?
+  uint64 qtime;     // when the request was queued
+  struct buf *ionext; // I/O scheduler queue
+  struct buf *qnext; // next block in the same disk request
   uchar data[BSIZE];
 };
 
@@ -143,6 +143,12 @@ consoleintr(int c)
   case C('P'):  // Print process list.
     procdump();
     break;
+  case C('K'):  // Print kernel allocator statistics.
+    kmemdump();
+    break;
+  case C('O'):  // Print I/O scheduler statistics.
+    iosdump();
+    break;
   case C('U'):  // Kill line.
     while(cons.e != cons.w &&
           cons.buf[(cons.e-1) % INPUT_BUF] != '\n'){
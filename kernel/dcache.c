@@ -0,0 +1,142 @@
+//
+// Cache of directory lookups: maps a directory and a name
+// to the inum of the entry, or to 0 if the directory has
+// no such entry (a negative entry), so that path lookups
+// that hit don't read directory blocks.
+//
+// A directory's entries are only added or changed with the
+// directory locked: by dirlookup, dirlink, and sys_unlink.
+// Freeing a directory inode purges its entries, since the
+// inum may be reused. Replacement is by the clock algorithm.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+
+#define NDCACHE 512   // max cached lookups
+#define NDHASH 127
+
+struct dentry {
+  uint dev;
+  uint dir;             // inum of the directory; 0 if unused
+  char name[DIRSIZ];
+  uint inum;            // 0 for a negative entry
+  int used;             // referenced since the clock last passed
+  struct dentry *next;  // hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+  struct dentry *hash[NDHASH];
+  int hand;             // clock hand
+} dcache;
+
+void
+dcinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+static struct dentry**
+dchash(uint dev, uint dir, char *name)
+{
+  uint h = dev * 31 + dir;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.hash[h % NDHASH];
+}
+
+static struct dentry*
+dcfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dchash(dp->dev, dp->inum, name); d; d = d->next)
+    if(d->dev == dp->dev && d->dir == dp->inum && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+static void
+dcunhash(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dchash(d->dev, d->dir, d->name); *pp; pp = &(*pp)->next){
+    if(*pp == d){
+      *pp = d->next;
+      break;
+    }
+  }
+  d->dir = 0;
+}
+
+// Look up name in directory dp. If cached, set *inum
+// (0 if there is no such entry) and return 1.
+// Caller must hold dp->lock.
+int
+dclookup(struct inode *dp, char *name, uint *inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) != 0){
+    d->used = 1;
+    *inum = d->inum;
+  }
+  release(&dcache.lock);
+  return d != 0;
+}
+
+// Record that name in directory dp refers to inum,
+// or doesn't exist if inum is 0.
+// Caller must hold dp->lock.
+void
+dcenter(struct inode *dp, char *name, uint inum)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dcfind(dp, name)) == 0){
+    for(;;){
+      d = &dcache.ent[dcache.hand];
+      dcache.hand = (dcache.hand + 1) % NDCACHE;
+      if(d->dir == 0)
+        break;
+      if(!d->used){
+        dcunhash(d);
+        break;
+      }
+      d->used = 0;
+    }
+    d->dev = dp->dev;
+    d->dir = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    d->next = *dchash(dp->dev, dp->inum, name);
+    *dchash(dp->dev, dp->inum, name) = d;
+  }
+  d->inum = inum;
+  d->used = 1;
+  release(&dcache.lock);
+}
+
+// Drop the entries of directory dp, which is being freed.
+void
+dcpurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDCACHE]; d++)
+    if(d->dir == dp->inum && d->dev == dp->dev)
+      dcunhash(d);
+  release(&dcache.lock);
+}
@@ -14,8 +14,14 @@ void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bawrite(struct buf*);
+void            bawritev(struct buf**, int);
+void            bwait(struct buf*);
+void            bprefetch(uint, uint);
+void            bprefetchv(uint, uint*, int);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
+void            bwakeup(void);
 
 // console.c
 void            consoleinit(void);
@@ -50,6 +56,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+uint            bmap(struct inode*, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -63,13 +70,34 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            kmemdump(void);
+void            kdup(void *);
+int             krefcnt(void *);
+uint64          kfreepages(void);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
+void            log_flush(void);
 void            begin_op(void);
 void            end_op(void);
 
+// mmap.c
+uint64          mmapbase(struct proc*);
+uint64          mmap(struct proc*, uint64, int, int, struct file*, uint);
+int             mmapfault(struct proc*, uint64, int);
+int             munmap(struct proc*, uint64, uint64);
+void            munmapall(struct proc*);
+int             mmapdup(struct proc*, struct proc*);
+
+// pcache.c
+void            pcinit(void);
+char*           pcget(struct inode*, uint);
+void            pcwrite(struct inode*, uint, char*, uint);
+void            pcinval(struct inode*);
+int             pcshrink(int);
+void            pcreadahead(struct inode*, uint, uint);
+
 // pipe.c
 int             pipealloc(struct file**, struct file**);
 void            pipeclose(struct pipe*, int);
@@ -89,6 +117,7 @@ int             growproc(int);
 pagetable_t     proc_pagetable(struct proc *);
 void            proc_freepagetable(pagetable_t, uint64);
 int             kill(int);
+void            kthread_create(void (*)(void), char*);
 struct cpu*     mycpu(void);
 struct cpu*     getmycpu(void);
 struct proc*    myproc();
@@ -139,6 +168,12 @@ int             fetchstr(uint64, char*, int);
 int             fetchaddr(uint64, uint64*);
 void            syscall();
 
+// dcache.c
+void            dcinit(void);
+int             dclookup(struct inode*, char*, uint*);
+void            dcenter(struct inode*, char*, uint);
+void            dcpurge(struct inode*);
+
 // trap.c
 extern uint     ticks;
 void            trapinit(void);
@@ -163,10 +198,14 @@ pagetable_t     uvmcreate(void);
 void            uvminit(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+int             cowcopy(pagetable_t, uint64);
+int             vmfault(struct proc*, uint64, int);
+void            vmprefault(struct proc*, uint64, uint64);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
+pte_t *         walk(pagetable_t, uint64, int);
 uint64          walkaddr(pagetable_t, uint64);
 int             copyout(pagetable_t, uint64, char *, uint64);
 int             copyin(pagetable_t, char *, uint64, uint64);
@@ -178,9 +217,18 @@ void            plicinithart(void);
 int             plic_claim(void);
 void            plic_complete(int);
 
+// iosched.c
+void            iosinit(void);
+void            iosubmit(struct buf**, int, int);
+void            iowait(struct buf*);
+void            iodone(struct buf*);
+void            iosdump(void);
+
 // virtio_disk.c
 void            virtio_disk_init(void);
-void            virtio_disk_rw(struct buf *, int);
+int             virtio_disk_room(void);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_kick(void);
 void            virtio_disk_intr(void);
 
 // number of elements in fixed-size array
@@ -13,6 +13,8 @@
 #include "stat.h"
 #include "proc.h"
 
+#define RAMAX 8  // max readahead window, in pages
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -101,6 +103,32 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// If f is being read sequentially, start reading the
+// pages after the n bytes about to be read, in the
+// background. The window doubles with each sequential
+// read, up to RAMAX pages. Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, int n)
+{
+  uint pg, end;
+
+  if(f->off != f->raoff){
+    f->rawin = 0;
+    return;
+  }
+  f->rawin = f->rawin ? f->rawin * 2 : 1;
+  if(f->rawin > RAMAX)
+    f->rawin = RAMAX;
+  pg = PGROUNDUP(f->off + n) / PGSIZE;
+  end = pg + f->rawin;
+  if(pg < f->rapg)
+    pg = f->rapg;
+  if(pg < end){
+    pcreadahead(f->ip, pg, end - pg);
+    f->rapg = end;
+  }
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
@@ -111,6 +139,9 @@ fileread(struct file *f, uint64 addr, int n)
   if(f->readable == 0)
     return -1;
 
+  // the copyout may happen with locks held.
+  vmprefault(myproc(), addr, n);
+
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -119,8 +150,10 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    readahead(f, n);
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    f->raoff = f->off;
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -139,6 +172,9 @@ filewrite(struct file *f, uint64 addr, int n)
   if(f->writable == 0)
     return -1;
 
+  // the copyin may happen with locks held.
+  vmprefault(myproc(), addr, n);
+
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
   } else if(f->type == FD_DEVICE){
@@ -148,11 +184,11 @@ filewrite(struct file *f, uint64 addr, int n)
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
     // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
+    // i-node, up to 3 indirect blocks, allocation blocks,
     // and 2 blocks of slop for non-aligned writes.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = ((MAXOPBLOCKS-1-3-2) / 2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
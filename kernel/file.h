@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint raoff;        // FD_INODE: where the last read ended
+  uint rapg;         // FD_INODE: first page not yet read ahead
+  uint rawin;        // FD_INODE: readahead window, in pages
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +21,9 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  struct inode *next;   // hash chain
+  struct inode *fprev;  // free list, if ref is 0
+  struct inode *fnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +32,12 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  union {
+    uint addrs[NDIRECT+3];
+    struct extentroot eroot;
+  };
+  struct extent ecache; // last extent bmap used, if extent-mapped
+  uint goal;          // where to allocate its next block
 };
 
 // map major device number to device functions.
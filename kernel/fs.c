@@ -13,6 +13,7 @@
 #include "riscv.h"
 #include "defs.h"
 #include "param.h"
+#include "memlayout.h"
 #include "stat.h"
 #include "spinlock.h"
 #include "proc.h"
@@ -37,6 +38,8 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bginit(int);
+
 // Init fs
 void
 fsinit(int dev) {
@@ -44,6 +47,7 @@ fsinit(int dev) {
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
   initlog(dev, &sb);
+  bginit(dev);
 }
 
 // Zero a block.
@@ -59,30 +63,109 @@ bzero(int dev, int bno)
 }
 
 // Blocks.
+//
+// The disk is divided into allocation groups, one per bitmap
+// block. For each group the kernel keeps a count of its free
+// blocks and the lowest block that may be free, so balloc()
+// skips full groups without reading their bitmap blocks, and
+// doesn't rescan their allocated prefix.
 
-// Allocate a zeroed disk block.
-static uint
-balloc(uint dev)
+#define NGROUP 64  // max allocation groups
+#define GSTART(g) ((g) * BPB)
+#define GEND(g) ((g) == bgroup.n - 1 ? sb.size : ((g) + 1) * BPB)
+
+struct {
+  struct spinlock lock;
+  int n;
+  uint nfree[NGROUP];
+  uint first[NGROUP];  // blocks below this are in use
+} bgroup;
+
+// Count each group's free blocks.
+static void
+bginit(int dev)
 {
-  int b, bi, m;
   struct buf *bp;
-
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
+  uint g, b;
+
+  initlock(&bgroup.lock, "bgroup");
+  bgroup.n = (sb.size + BPB - 1) / BPB;
+  if(bgroup.n > NGROUP)
+    panic("bginit: too many groups");
+  for(g = 0; g < bgroup.n; g++){
+    bp = bread(dev, BBLOCK(GSTART(g), sb));
+    bgroup.first[g] = GEND(g);
+    for(b = GSTART(g); b < GEND(g); b++){
+      if((bp->data[(b % BPB)/8] & (1 << (b % 8))) == 0){
+        bgroup.nfree[g]++;
+        if(bgroup.first[g] == GEND(g))
+          bgroup.first[g] = b;
       }
     }
     brelse(bp);
   }
-  panic("balloc: out of blocks");
+}
+
+// Allocate the first free block of group g at or after from,
+// or return 0.
+static uint
+bscan(uint dev, uint g, uint from)
+{
+  uint b, m, first;
+  struct buf *bp;
+
+  acquire(&bgroup.lock);
+  if(bgroup.nfree[g] == 0){
+    release(&bgroup.lock);
+    return 0;
+  }
+  release(&bgroup.lock);
+
+  // the bitmap block's lock keeps first steady.
+  bp = bread(dev, BBLOCK(GSTART(g), sb));
+  acquire(&bgroup.lock);
+  first = bgroup.first[g];
+  release(&bgroup.lock);
+  if(from < first)
+    from = first;
+  for(b = from; b < GEND(g); b++){
+    m = 1 << (b % 8);
+    if((bp->data[(b % BPB)/8] & m) == 0){  // Is block free?
+      bp->data[(b % BPB)/8] |= m;  // Mark block in use.
+      log_write(bp);
+      acquire(&bgroup.lock);
+      bgroup.nfree[g]--;
+      if(from == first)
+        bgroup.first[g] = b + 1;
+      release(&bgroup.lock);
+      brelse(bp);
+      return b;
+    }
+  }
+  brelse(bp);
+  return 0;
+}
+
+// Allocate a zeroed disk block: goal if it's free, so
+// that a file can grow contiguously, else the next free
+// block after goal in its group, else the first free
+// block of the following groups.
+static uint
+balloc(uint dev, uint goal)
+{
+  uint b, g;
+  int i;
+
+  if(goal >= sb.size)
+    goal = 0;
+  g = goal / BPB;
+  b = bscan(dev, g, goal);
+  for(i = 1; b == 0 && i <= bgroup.n; i++)
+    b = bscan(dev, (g + i) % bgroup.n, 0);
+  if(b == 0)
+    panic("balloc: out of blocks");
+  bzero(dev, b);
+  return b;
 }
 
 // Free a disk block.
@@ -99,9 +182,33 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  acquire(&bgroup.lock);
+  bgroup.nfree[b / BPB]++;
+  if(b < bgroup.first[b / BPB])
+    bgroup.first[b / BPB] = b;
+  release(&bgroup.lock);
   brelse(bp);
 }
 
+// The allocation group of ip's inode, so that files
+// spread over the disk rather than interleaving.
+static uint
+igroup(struct inode *ip)
+{
+  return GSTART(ip->inum % bgroup.n);
+}
+
+// Allocate a block for ip, after the last one it got.
+static uint
+ibnew(struct inode *ip)
+{
+  uint b;
+
+  b = balloc(ip->dev, ip->goal ? ip->goal : igroup(ip));
+  ip->goal = b + 1;
+  return b;
+}
+
 // Inodes.
 //
 // An inode describes a single unnamed file.
@@ -136,9 +243,12 @@ bfree(int dev, uint b)
 //
 // * Valid: the information (type, size, &c) in an inode
 //   cache entry is only correct when ip->valid is 1.
-//   ilock() reads the inode from
-//   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ilock() reads the inode from the disk and sets
+//   ip->valid, while iput() clears ip->valid when it
+//   frees the inode. An entry whose ref has fallen to zero
+//   stays valid on the free list until it is recycled,
+//   least recently used first, so that iget() of a recently
+//   used inode doesn't have to read it again.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -162,28 +272,88 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
-// The icache.lock spin-lock protects the allocation of icache
-// entries. Since ip->ref indicates whether an entry is free,
-// and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold icache.lock while using any of those fields.
+// Cache entries are found through a hash table on (dev, inum).
+// Each bucket's lock protects the ref and hash chain of the
+// entries in it. Since ip->dev and ip->inum decide the bucket,
+// they only change when an entry is recycled, which is
+// serialized by icache.lock. icache.freelock protects the
+// free list of entries with ref 0, and nests inside bucket locks.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
-struct {
+#define NIBUCKET 61
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIBUCKET)
+#define IMEMPER (64*1024)  // bytes of RAM per cached inode
+
+struct ibucket {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *head;
+};
+
+struct {
+  struct spinlock lock;      // serializes recycling
+  struct ibucket bucket[NIBUCKET];
+  struct spinlock freelock;
+  struct inode *free;        // free list, most recently used first
+  struct inode *lastfree;    // least recently used
 } icache;
 
+// Add ip, whose ref has just fallen to 0, to the free list.
+// Caller must hold icache.freelock.
+static void
+ifreeadd(struct inode *ip)
+{
+  ip->fprev = 0;
+  ip->fnext = icache.free;
+  if(icache.free)
+    icache.free->fprev = ip;
+  else
+    icache.lastfree = ip;
+  icache.free = ip;
+}
+
+// Caller must hold icache.freelock.
+static void
+ifreeremove(struct inode *ip)
+{
+  if(ip->fprev)
+    ip->fprev->fnext = ip->fnext;
+  else
+    icache.free = ip->fnext;
+  if(ip->fnext)
+    ip->fnext->fprev = ip->fprev;
+  else
+    icache.lastfree = ip->fprev;
+}
+
+// Size the cache by the amount of memory, and put every
+// entry on the free list, in the bucket of inode 0.
 void
 iinit()
 {
-  int i = 0;
-  
+  struct inode *ip;
+  int i, n;
+
   initlock(&icache.lock, "icache");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&icache.inode[i].lock, "inode");
+  initlock(&icache.freelock, "icache.free");
+  for(i = 0; i < NIBUCKET; i++)
+    initlock(&icache.bucket[i].lock, "icache.bucket");
+
+  n = (PHYSTOP - KERNBASE) / IMEMPER;
+  if(n < NINODE)
+    n = NINODE;
+  while(n > 0){
+    if((ip = (struct inode*)kalloc()) == 0)
+      panic("iinit");
+    memset(ip, 0, PGSIZE);
+    for(i = 0; i < PGSIZE / sizeof(*ip) && n > 0; i++, ip++, n--){
+      initsleeplock(&ip->lock, "inode");
+      ip->next = icache.bucket[IHASH(0, 0)].head;
+      icache.bucket[IHASH(0, 0)].head = ip;
+      ifreeadd(ip);
+    }
   }
 }
 
@@ -236,39 +406,92 @@ iupdate(struct inode *ip)
   brelse(bp);
 }
 
-// Find the inode with number inum on device dev
-// and return the in-memory copy. Does not lock
-// the inode and does not read it from disk.
+// Look for inode inum of dev in bucket bkt, and take
+// a reference to it if it's there.
+// Caller must hold bkt->lock.
 static struct inode*
-iget(uint dev, uint inum)
+ifind(struct ibucket *bkt, uint dev, uint inum)
 {
-  struct inode *ip, *empty;
-
-  acquire(&icache.lock);
+  struct inode *ip;
 
-  // Is the inode already cached?
-  empty = 0;
-  for(ip = &icache.inode[0]; ip < &icache.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
-      release(&icache.lock);
+  for(ip = bkt->head; ip != 0; ip = ip->next){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0){
+        acquire(&icache.freelock);
+        ifreeremove(ip);
+        release(&icache.freelock);
+      }
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
+  return 0;
+}
 
-  // Recycle an inode cache entry.
-  if(empty == 0)
-    panic("iget: no inodes");
-
-  ip = empty;
+// Take the least recently used free entry out of its bucket,
+// and return it with ref 1 for inode inum of dev, in bucket bkt.
+// Caller must hold icache.lock.
+static struct inode*
+irecycle(struct ibucket *bkt, uint dev, uint inum)
+{
+  struct ibucket *old;
+  struct inode *ip, **pp;
+
+  for(;;){
+    acquire(&icache.freelock);
+    ip = icache.lastfree;
+    release(&icache.freelock);
+    if(ip == 0)
+      panic("iget: no inodes");
+    old = &icache.bucket[IHASH(ip->dev, ip->inum)];
+    acquire(&old->lock);
+    if(ip->ref == 0)
+      break;
+    release(&old->lock);  // iget() took it meanwhile
+  }
+  acquire(&icache.freelock);
+  ifreeremove(ip);
+  release(&icache.freelock);
+  for(pp = &old->head; *pp != ip; pp = &(*pp)->next)
+    ;
+  *pp = ip->next;
+  release(&old->lock);
+
+  acquire(&bkt->lock);
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
-  release(&icache.lock);
+  ip->next = bkt->head;
+  bkt->head = ip;
+  release(&bkt->lock);
+  return ip;
+}
+
+// Find the inode with number inum on device dev
+// and return the in-memory copy. Does not lock
+// the inode and does not read it from disk.
+static struct inode*
+iget(uint dev, uint inum)
+{
+  struct ibucket *bkt = &icache.bucket[IHASH(dev, inum)];
+  struct inode *ip;
 
+  // Is the inode already cached?
+  acquire(&bkt->lock);
+  ip = ifind(bkt, dev, inum);
+  release(&bkt->lock);
+  if(ip)
+    return ip;
+
+  // Not cached. Only one process at a time may recycle, so
+  // no one else can insert this inode while we look.
+  acquire(&icache.lock);
+  acquire(&bkt->lock);
+  ip = ifind(bkt, dev, inum);
+  release(&bkt->lock);
+  if(ip == 0)
+    ip = irecycle(bkt, dev, inum);
+  release(&icache.lock);
   return ip;
 }
 
@@ -277,9 +500,11 @@ iget(uint dev, uint inum)
 struct inode*
 idup(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bkt = &icache.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bkt->lock);
   ip->ref++;
-  release(&icache.lock);
+  release(&bkt->lock);
   return ip;
 }
 
@@ -305,6 +530,8 @@ ilock(struct inode *ip)
     ip->nlink = dip->nlink;
     ip->size = dip->size;
     memmove(ip->addrs, dip->addrs, sizeof(ip->addrs));
+    ip->ecache.len = 0;
+    ip->goal = 0;
     brelse(bp);
     ip->valid = 1;
     if(ip->type == 0)
@@ -332,7 +559,9 @@ iunlock(struct inode *ip)
 void
 iput(struct inode *ip)
 {
-  acquire(&icache.lock);
+  struct ibucket *bkt = &icache.bucket[IHASH(ip->dev, ip->inum)];
+
+  acquire(&bkt->lock);
 
   if(ip->ref == 1 && ip->valid && ip->nlink == 0){
     // inode has no links and no other references: truncate and free.
@@ -341,8 +570,10 @@ iput(struct inode *ip)
     // so this acquiresleep() won't block (or deadlock).
     acquiresleep(&ip->lock);
 
-    release(&icache.lock);
+    release(&bkt->lock);
 
+    if(ip->type == T_DIR)
+      dcpurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -350,11 +581,15 @@ iput(struct inode *ip)
 
     releasesleep(&ip->lock);
 
-    acquire(&icache.lock);
+    acquire(&bkt->lock);
   }
 
-  ip->ref--;
-  release(&icache.lock);
+  if(--ip->ref == 0){
+    acquire(&icache.freelock);
+    ifreeadd(ip);
+    release(&icache.freelock);
+  }
+  release(&bkt->lock);
 }
 
 // Common idiom: unlock, then put.
@@ -370,38 +605,303 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// are listed in the blocks listed in block ip->addrs[NDIRECT+1]
+// (doubly indirect), and the last NTINDIRECT are reached the
+// same way through three levels from ip->addrs[NDIRECT+2].
+
+// Return the block that entry i of ip's indirect block
+// addr points to, allocating it if necessary.
+static uint
+bindirect(struct inode *ip, uint addr, uint i)
+{
+  struct buf *bp;
+  uint *a;
+
+  bp = bread(ip->dev, addr);
+  a = (uint*)bp->data;
+  if((addr = a[i]) == 0){
+    a[i] = addr = ibnew(ip);
+    log_write(bp);
+  }
+  brelse(bp);
+  return addr;
+}
+
+static uint ebmap(struct inode*, uint);
 
 // Return the disk block address of the nth block in inode ip.
 // If there is no such block, bmap allocates one.
-static uint
+uint
 bmap(struct inode *ip, uint bn)
 {
-  uint addr, *a;
-  struct buf *bp;
+  uint addr, n, div;
+  int level;
+
+  if(sb.flags & FS_EXTENTS)
+    return ebmap(ip, bn);
+
+  // appending to a file just read from disk: continue
+  // after its last block.
+  if(ip->goal == 0 && bn > 0 && bn * BSIZE >= ip->size)
+    ip->goal = bmap(ip, bn - 1) + 1;
 
   if(bn < NDIRECT){
     if((addr = ip->addrs[bn]) == 0)
-      ip->addrs[bn] = addr = balloc(ip->dev);
+      ip->addrs[bn] = addr = ibnew(ip);
     return addr;
   }
   bn -= NDIRECT;
 
-  if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0)
-      ip->addrs[NDIRECT] = addr = balloc(ip->dev);
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      a[bn] = addr = balloc(ip->dev);
-      log_write(bp);
+  // Find the levels of indirection below ip->addrs[NDIRECT+level],
+  // and the number of blocks each entry of that block covers.
+  n = NINDIRECT;
+  div = 1;
+  for(level = 0; bn >= n; level++){
+    if(level == 2)
+      panic("bmap: out of range");
+    bn -= n;
+    n *= NINDIRECT;
+    div *= NINDIRECT;
+  }
+
+  // Load the top indirect block, allocating if necessary,
+  // then walk down one indirect block per level.
+  if((addr = ip->addrs[NDIRECT+level]) == 0)
+    ip->addrs[NDIRECT+level] = addr = ibnew(ip);
+  for(; div > 0; div /= NINDIRECT)
+    addr = bindirect(ip, addr, bn / div % NINDIRECT);
+  return addr;
+}
+
+// Free indirect block addr and the blocks it points to,
+// which are themselves indirect if level > 0.
+static void
+bfreeind(uint dev, uint addr, int level)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(dev, addr);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(level > 0)
+      bfreeind(dev, a[j], level-1);
+    else
+      bfree(dev, a[j]);
+  }
+  brelse(bp);
+  bfree(dev, addr);
+}
+
+// Extent-mapped inodes.
+//
+// Files only grow at the end, so a new block either extends the
+// last extent, when balloc() can give the block that follows it,
+// or starts a new extent at the right edge of the tree. The last
+// extent used is cached in ip->ecache, so sequential access
+// looks up the tree once per extent, not once per block.
+
+#define EROOT(ip)  (&(ip)->eroot.h)
+#define EHDR(bp)   ((struct extenthdr*)(bp)->data)
+#define EXT(h)     ((struct extent*)((h) + 1))
+
+// Find the leaf extent containing file block bn. Returns 0 if
+// bn is past the last extent.
+static int
+elookup(struct inode *ip, uint bn, struct extent *e)
+{
+  struct extenthdr *h = EROOT(ip);
+  struct buf *bp = 0;
+  struct extent *x;
+  int lo, hi, mid, found;
+
+  for(;;){
+    // binary search for the last entry with lblk <= bn.
+    x = EXT(h);
+    lo = 0;
+    hi = h->n;
+    while(hi - lo > 1){
+      mid = (lo + hi) / 2;
+      if(x[mid].lblk <= bn)
+        lo = mid;
+      else
+        hi = mid;
     }
+    if(h->n == 0 || h->depth == 0)
+      break;
+    uint child = x[lo].start;
+    if(bp)
+      brelse(bp);
+    bp = bread(ip->dev, child);
+    h = EHDR(bp);
+  }
+  found = h->n > 0 && bn - x[lo].lblk < x[lo].len;
+  if(found)
+    *e = x[lo];
+  if(bp)
     brelse(bp);
-    return addr;
+  return found;
+}
+
+// Return the file's last extent, or 0 if it has none. Sets
+// *bpp to the locked buf holding it, or 0 if it's in the inode.
+static struct extent*
+elast(struct inode *ip, struct buf **bpp)
+{
+  struct extenthdr *h = EROOT(ip);
+  struct buf *bp = 0;
+
+  while(h->n > 0 && h->depth > 0){
+    uint child = EXT(h)[h->n-1].start;
+    if(bp)
+      brelse(bp);
+    bp = bread(ip->dev, child);
+    h = EHDR(bp);
+  }
+  *bpp = bp;
+  if(h->n == 0)
+    return 0;
+  return &EXT(h)[h->n-1];
+}
+
+// Allocate a chain of depth+1 nodes holding only extent e.
+static uint
+enew(struct inode *ip, int depth, struct extent *e)
+{
+  struct buf *bp;
+  struct extenthdr *h;
+  uint addr;
+
+  addr = balloc(ip->dev, igroup(ip));
+  bp = bread(ip->dev, addr);
+  h = EHDR(bp);
+  h->n = 1;
+  h->depth = depth;
+  EXT(h)[0] = *e;
+  if(depth > 0)
+    EXT(h)[0].start = enew(ip, depth-1, e);
+  log_write(bp);
+  brelse(bp);
+  return addr;
+}
+
+// Add extent e after all others in the subtree under node h,
+// which has room for max entries. Returns 0 if it's full.
+static int
+eappend(struct inode *ip, struct extenthdr *h, int max, struct extent *e)
+{
+  struct extent *x = EXT(h);
+  struct buf *bp;
+  int ok;
+
+  if(h->depth > 0 && h->n > 0){
+    bp = bread(ip->dev, x[h->n-1].start);
+    if((ok = eappend(ip, EHDR(bp), NNODEEXT, e)) != 0)
+      log_write(bp);
+    brelse(bp);
+    if(ok)
+      return 1;
+  }
+  if(h->n == max)
+    return 0;
+  x[h->n] = *e;
+  if(h->depth > 0)
+    x[h->n].start = enew(ip, h->depth-1, e);
+  h->n++;
+  return 1;
+}
+
+// Add extent e at the end of ip's tree.
+static void
+eadd(struct inode *ip, struct extent *e)
+{
+  struct extenthdr *h = EROOT(ip);
+  struct buf *bp;
+  uint addr;
+
+  if(eappend(ip, h, NROOTEXT, e))
+    return;
+
+  // the tree is full: move the root's entries down into a
+  // new node, and make that node the root's only child.
+  addr = balloc(ip->dev, igroup(ip));
+  bp = bread(ip->dev, addr);
+  memmove(bp->data, h, sizeof(*h) + h->n * sizeof(struct extent));
+  log_write(bp);
+  brelse(bp);
+  h->n = 1;
+  h->depth++;
+  EXT(h)[0].lblk = 0;
+  EXT(h)[0].start = addr;
+  EXT(h)[0].len = 0;
+  if(!eappend(ip, h, NROOTEXT, e))
+    panic("eadd");
+}
+
+// bmap() for extent-mapped inodes.
+static uint
+ebmap(struct inode *ip, uint bn)
+{
+  struct extent e, *last;
+  struct buf *bp;
+  uint addr, goal;
+
+  if(bn - ip->ecache.lblk < ip->ecache.len)
+    return ip->ecache.start + (bn - ip->ecache.lblk);
+  if(elookup(ip, bn, &e)){
+    ip->ecache = e;
+    return e.start + (bn - e.lblk);
   }
 
-  panic("bmap: out of range");
+  // bn is the block after the end of the file.
+  goal = igroup(ip);
+  if((last = elast(ip, &bp)) != 0){
+    if(last->lblk + last->len != bn)
+      panic("ebmap: hole");
+    goal = last->start + last->len;
+  }
+  addr = balloc(ip->dev, goal);
+  if(last && addr == goal){
+    last->len++;
+    e = *last;
+    if(bp)
+      log_write(bp);
+  } else {
+    e.lblk = bn;
+    e.start = addr;
+    e.len = 1;
+  }
+  if(bp)
+    brelse(bp);
+  if(e.lblk == bn)
+    eadd(ip, &e);
+  ip->ecache = e;
+  return addr;
+}
+
+// Free the blocks mapped by the n extents x at depth,
+// and the nodes below them.
+static void
+efree(uint dev, struct extent *x, int n, int depth)
+{
+  struct buf *bp;
+  uint b;
+
+  for(int i = 0; i < n; i++){
+    if(depth == 0){
+      for(b = 0; b < x[i].len; b++)
+        bfree(dev, x[i].start + b);
+    } else {
+      bp = bread(dev, x[i].start);
+      efree(dev, EXT(EHDR(bp)), EHDR(bp)->n, EHDR(bp)->depth);
+      brelse(bp);
+      bfree(dev, x[i].start);
+    }
+  }
 }
 
 // Truncate inode (discard contents).
@@ -409,9 +909,18 @@ bmap(struct inode *ip, uint bn)
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  pcinval(ip);
+
+  if(sb.flags & FS_EXTENTS){
+    efree(ip->dev, EXT(EROOT(ip)), EROOT(ip)->n, EROOT(ip)->depth);
+    memset(ip->addrs, 0, sizeof(ip->addrs));
+    ip->ecache.len = 0;
+    ip->size = 0;
+    iupdate(ip);
+    return;
+  }
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -420,18 +929,14 @@ itrunc(struct inode *ip)
     }
   }
 
-  if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
+  for(i = 0; i < 3; i++){
+    if(ip->addrs[NDIRECT+i]){
+      bfreeind(ip->dev, ip->addrs[NDIRECT+i], i);
+      ip->addrs[NDIRECT+i] = 0;
     }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
-    ip->addrs[NDIRECT] = 0;
   }
 
+  ip->goal = 0;
   ip->size = 0;
   iupdate(ip);
 }
@@ -456,7 +961,9 @@ int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
   uint tot, m;
+  int r;
   struct buf *bp;
+  char *pa;
 
   if(off > ip->size || off + n < off)
     return 0;
@@ -464,13 +971,19 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
     n = ip->size - off;
 
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    bp = bread(ip->dev, bmap(ip, off/BSIZE));
-    m = min(n - tot, BSIZE - off%BSIZE);
-    if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
+    if((pa = pcget(ip, off/PGSIZE)) != 0){
+      m = min(n - tot, PGSIZE - off%PGSIZE);
+      r = either_copyout(user_dst, dst, pa + (off % PGSIZE), m);
+      kfree(pa);
+    } else {
+      // out of memory; read through the buffer cache.
+      bp = bread(ip->dev, bmap(ip, off/BSIZE));
+      m = min(n - tot, BSIZE - off%BSIZE);
+      r = either_copyout(user_dst, dst, bp->data + (off % BSIZE), m);
       brelse(bp);
-      break;
     }
-    brelse(bp);
+    if(r == -1)
+      break;
   }
   return tot;
 }
@@ -498,6 +1011,7 @@ writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
       break;
     }
     log_write(bp);
+    pcwrite(ip, off, (char*)bp->data + (off % BSIZE), m);
     brelse(bp);
   }
 
@@ -521,16 +1035,411 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
-// Look for a directory entry in a directory.
-// If found, set *poff to byte offset of entry.
-struct inode*
-dirlookup(struct inode *dp, char *name, uint *poff)
+// Hashed directories.
+
+#define DPB     (BSIZE / sizeof(struct dirent))   // dirents per block
+#define DXENT(h) ((struct dxentry*)((h) + 1))
+
+static uint
+dxhash(char *name)
+{
+  uint h = 2166136261;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++){
+    h ^= (uchar)name[i];
+    h *= 16777619;
+  }
+  return h & ~1;  // odd hashes mark continued runs
+}
+
+static struct buf*
+dirblock(struct inode *dp, uint fbn)
+{
+  return bread(dp->dev, bmap(dp, fbn));
+}
+
+// Log block fbn of directory dp, modified in bp.
+static void
+dirwrite(struct inode *dp, struct buf *bp, uint fbn)
+{
+  log_write(bp);
+  pcwrite(dp, fbn * BSIZE, (char*)bp->data, BSIZE);
+}
+
+// Add a zeroed block to the end of directory dp,
+// and return its file block number.
+static uint
+dirgrow(struct inode *dp)
+{
+  uint fbn = dp->size / BSIZE;
+
+  bmap(dp, fbn);
+  dp->size += BSIZE;
+  iupdate(dp);
+  return fbn;
+}
+
+// The index header in block fbn of a hashed directory;
+// in block 0 it follows "." and "..".
+static struct dxhdr*
+dxhdr(struct buf *bp, uint fbn)
+{
+  return (struct dxhdr*)((struct dirent*)bp->data + (fbn == 0 ? 2 : 0));
+}
+
+// Max entries of the index in block fbn.
+static int
+dxmax(uint fbn)
+{
+  return DPB - (fbn == 0 ? 3 : 1);
+}
+
+// Is dp, whose block 0 is in root, a hashed directory?
+static int
+dxindexed(struct inode *dp, struct buf *root)
+{
+  return dp->size > BSIZE && dxhdr(root, 0)->magic == DXMAGIC;
+}
+
+// Index of the last entry in h whose hash is <= hash.
+static int
+dxsearch(struct dxhdr *h, uint hash)
+{
+  struct dxentry *e = DXENT(h);
+  int lo = 0, hi = h->n, mid;
+
+  while(hi - lo > 1){
+    mid = (lo + hi) / 2;
+    if(e[mid].hash <= hash)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+// The index nodes on the way from the root to a leaf.
+struct dxpath {
+  int n;
+  struct buf *bp[2];
+  uint fbn[2];
+  int slot[2];  // entry followed in each node
+};
+
+// Walk hashed directory dp's index from the root, whose buf
+// is root, to the leaf for hash, and return the leaf's file
+// block. Any index block stays locked in p->bp[1].
+static uint
+dxwalk(struct inode *dp, struct buf *root, uint hash, struct dxpath *p)
+{
+  struct dxhdr *h = dxhdr(root, 0);
+  uint fbn = 0;
+
+  p->bp[0] = root;
+  for(p->n = 0; ; p->n++){
+    p->fbn[p->n] = fbn;
+    p->slot[p->n] = dxsearch(h, hash);
+    fbn = DXENT(h)[p->slot[p->n]].block;
+    if(p->n == dxhdr(root, 0)->levels)
+      break;
+    p->bp[p->n+1] = dirblock(dp, fbn);
+    h = dxhdr(p->bp[p->n+1], fbn);
+  }
+  p->n++;
+  return fbn;
+}
+
+// If the leaf after the one p leads to continues the run of
+// names with hash (see dxsplit), advance p to it and return
+// its block, else return 0.
+static uint
+dxnext(struct inode *dp, struct dxpath *p, uint hash)
+{
+  struct dxhdr *h;
+  int i;
+
+  for(i = p->n - 1; i >= 0; i--)
+    if(p->slot[i] + 1 < dxhdr(p->bp[i], p->fbn[i])->n)
+      break;
+  if(i < 0)
+    return 0;
+  h = dxhdr(p->bp[i], p->fbn[i]);
+  if(DXENT(h)[p->slot[i]+1].hash != (hash | 1))
+    return 0;
+  p->slot[i]++;
+  if(i < p->n - 1){
+    // the run goes on in the next index block.
+    brelse(p->bp[1]);
+    p->fbn[1] = DXENT(h)[p->slot[0]].block;
+    p->bp[1] = dirblock(dp, p->fbn[1]);
+    p->slot[1] = 0;
+  }
+  h = dxhdr(p->bp[p->n-1], p->fbn[p->n-1]);
+  return DXENT(h)[p->slot[p->n-1]].block;
+}
+
+static void
+dxrelse(struct dxpath *p)
+{
+  if(p->n > 1)
+    brelse(p->bp[1]);
+}
+
+// Turn dp, a linear directory whose one block is full, into
+// a hashed directory with a single leaf.
+static void
+dxconvert(struct inode *dp, struct buf *root)
+{
+  struct dirent *de = (struct dirent*)root->data;
+  struct dxhdr *h;
+  struct buf *bp;
+  uint fbn;
+
+  fbn = dirgrow(dp);
+  bp = dirblock(dp, fbn);
+  memmove(bp->data, de + 2, BSIZE - 2*sizeof(*de));
+  dirwrite(dp, bp, fbn);
+  brelse(bp);
+
+  memset(de + 2, 0, BSIZE - 2*sizeof(*de));
+  h = dxhdr(root, 0);
+  h->magic = DXMAGIC;
+  h->levels = 0;
+  h->n = 1;
+  DXENT(h)[0].hash = 0;
+  DXENT(h)[0].block = fbn;
+  dirwrite(dp, root, 0);
+}
+
+// Insert entry (hash, block) in index node h after slot.
+static void
+dxput(struct dxhdr *h, int slot, uint hash, uint block)
+{
+  struct dxentry *e = DXENT(h);
+
+  memmove(e + slot + 2, e + slot + 1, (h->n - slot - 1) * sizeof(*e));
+  e[slot+1].hash = hash;
+  e[slot+1].block = block;
+  h->n++;
+}
+
+// Can an entry be added to the index along path p?
+static int
+dxroom(struct dxpath *p)
+{
+  struct dxhdr *root = dxhdr(p->bp[0], 0);
+
+  if(root->n < dxmax(0) || p->n == 1)
+    return 1;  // room, or the root can move down a level
+  return dxhdr(p->bp[1], p->fbn[1])->n < dxmax(p->fbn[1]);
+}
+
+// Add the entry (hash, block) for a new leaf, which follows
+// the leaf that p leads to. Caller has checked dxroom(p).
+static void
+dxinsert(struct inode *dp, struct dxpath *p, uint hash, uint block)
+{
+  struct dxhdr *root = dxhdr(p->bp[0], 0), *h, *nh;
+  struct buf *nbp;
+  uint nfbn;
+  int m;
+
+  if(p->n == 1 && root->n == dxmax(0)){
+    // move the root's entries down into an index block.
+    nfbn = dirgrow(dp);
+    p->bp[1] = dirblock(dp, nfbn);
+    h = dxhdr(p->bp[1], nfbn);
+    memmove(h, root, sizeof(*h) + root->n * sizeof(struct dxentry));
+    h->levels = 0;
+    root->levels = 1;
+    root->n = 1;
+    DXENT(root)[0].hash = 0;
+    DXENT(root)[0].block = nfbn;
+    dirwrite(dp, p->bp[0], 0);
+    p->fbn[1] = nfbn;
+    p->slot[1] = p->slot[0];
+    p->slot[0] = 0;
+    p->n = 2;
+  }
+
+  h = dxhdr(p->bp[p->n-1], p->fbn[p->n-1]);
+  if(h->n == dxmax(p->fbn[p->n-1])){
+    // split the full index block, and add the new
+    // half to the root.
+    nfbn = dirgrow(dp);
+    nbp = dirblock(dp, nfbn);
+    nh = dxhdr(nbp, nfbn);
+    m = h->n / 2;
+    nh->magic = DXMAGIC;
+    nh->n = h->n - m;
+    memmove(DXENT(nh), DXENT(h) + m, nh->n * sizeof(struct dxentry));
+    h->n = m;
+    dxput(root, p->slot[0], DXENT(nh)[0].hash, nfbn);
+    dirwrite(dp, p->bp[0], 0);
+    if(p->slot[1] >= m){
+      dirwrite(dp, p->bp[1], p->fbn[1]);
+      brelse(p->bp[1]);
+      p->bp[1] = nbp;
+      p->fbn[1] = nfbn;
+      p->slot[1] -= m;
+    } else {
+      dirwrite(dp, nbp, nfbn);
+      brelse(nbp);
+    }
+    h = dxhdr(p->bp[1], p->fbn[1]);
+  }
+  dxput(h, p->slot[p->n-1], hash, block);
+  dirwrite(dp, p->bp[p->n-1], p->fbn[p->n-1]);
+}
+
+// Split the full leaf in *bpp, block fbn, moving the upper
+// half of its entries by hash to a new leaf. If they all have
+// the same hash as the name being added, the new leaf starts
+// out empty, with hash+1 in the index to mark it as more of
+// the same run. Return the block of the leaf where hash
+// belongs, with its buf in *bpp, or 0 if the index is full.
+static uint
+dxsplit(struct inode *dp, struct dxpath *p, struct buf **bpp, uint fbn, uint hash)
+{
+  struct dirent *de = (struct dirent*)(*bpp)->data, *nde;
+  uint hs[DPB+1], split, t, nfbn;
+  struct buf *nbp;
+  int i, j, m;
+
+  if(!dxroom(p))
+    return 0;
+
+  // find the median hash, counting the new name's, so that
+  // equal hashes stay together.
+  for(i = 0; i <= DPB; i++){
+    t = i < DPB ? dxhash(de[i].name) : hash;
+    for(j = i; j > 0 && hs[j-1] > t; j--)
+      hs[j] = hs[j-1];
+    hs[j] = t;
+  }
+  for(m = DPB/2; m <= DPB && hs[m] == hs[m-1]; m++)
+    ;
+  if(m > DPB)
+    for(m = DPB/2; m > 0 && hs[m] == hs[m-1]; m--)
+      ;
+  split = m > 0 ? hs[m] : hash | 1;
+
+  nfbn = dirgrow(dp);
+  nbp = dirblock(dp, nfbn);
+  nde = (struct dirent*)nbp->data;
+  for(i = 0, j = 0; i < DPB; i++){
+    if(dxhash(de[i].name) >= split){
+      nde[j++] = de[i];
+      memset(&de[i], 0, sizeof(de[i]));
+    }
+  }
+  dirwrite(dp, *bpp, fbn);
+  dirwrite(dp, nbp, nfbn);
+  dxinsert(dp, p, split, nfbn);
+
+  if(m > 0 && hash < split){
+    brelse(nbp);
+    return fbn;
+  }
+  brelse(*bpp);
+  *bpp = nbp;
+  return nfbn;
+}
+
+// dirlink() for hashed directory dp, whose block 0 is in root.
+static int
+dxlink(struct inode *dp, struct buf *root, char *name, uint inum)
+{
+  struct dxpath p;
+  struct dirent *de;
+  struct buf *bp;
+  uint hash, fbn, nfbn;
+  int i, r;
+
+  hash = dxhash(name);
+  fbn = dxwalk(dp, root, hash, &p);
+  for(;;){
+    bp = dirblock(dp, fbn);
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DPB && de[i].inum != 0; i++)
+      ;
+    if(i < DPB || (nfbn = dxnext(dp, &p, hash)) == 0)
+      break;
+    brelse(bp);
+    fbn = nfbn;
+  }
+  if(i == DPB && (fbn = dxsplit(dp, &p, &bp, fbn, hash)) != 0){
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DPB && de[i].inum != 0; i++)
+      ;
+  }
+  r = -1;
+  if(i < DPB){
+    strncpy(de[i].name, name, DIRSIZ);
+    de[i].inum = inum;
+    dirwrite(dp, bp, fbn);
+    r = 0;
+  }
+  brelse(bp);
+  dxrelse(&p);
+  return r;
+}
+
+// Look up name in hashed directory dp, whose block 0 is in root.
+static uint
+dxlookup(struct inode *dp, struct buf *root, char *name, uint *poff)
+{
+  struct dxpath p;
+  struct dirent *de;
+  struct buf *bp;
+  uint hash, fbn, inum;
+  int i;
+
+  de = (struct dirent*)root->data;
+  for(i = 0; i < 2; i++){
+    if(namecmp(name, de[i].name) == 0){
+      *poff = i * sizeof(*de);
+      return de[i].inum;
+    }
+  }
+
+  hash = dxhash(name);
+  fbn = dxwalk(dp, root, hash, &p);
+  inum = 0;
+  do {
+    bp = dirblock(dp, fbn);
+    de = (struct dirent*)bp->data;
+    for(i = 0; i < DPB; i++){
+      if(de[i].inum != 0 && namecmp(name, de[i].name) == 0){
+        *poff = fbn * BSIZE + i * sizeof(*de);
+        inum = de[i].inum;
+        break;
+      }
+    }
+    brelse(bp);
+  } while(inum == 0 && (fbn = dxnext(dp, &p, hash)) != 0);
+  dxrelse(&p);
+  return inum;
+}
+
+// Read directory dp to find name. Returns its inum and sets
+// *poff to the byte offset of its entry, or returns 0.
+static uint
+dirscan(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
-
-  if(dp->type != T_DIR)
-    panic("dirlookup not DIR");
+  struct buf *root;
+
+  if(dp->size > BSIZE){
+    root = dirblock(dp, 0);
+    if(dxindexed(dp, root)){
+      inum = dxlookup(dp, root, name, poff);
+      brelse(root);
+      return inum;
+    }
+    brelse(root);
+  }
 
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -539,23 +1448,46 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       continue;
     if(namecmp(name, de.name) == 0){
       // entry matches path element
-      if(poff)
-        *poff = off;
-      inum = de.inum;
-      return iget(dp->dev, inum);
+      *poff = off;
+      return de.inum;
     }
   }
 
   return 0;
 }
 
+// Look for a directory entry in a directory.
+// If found, set *poff to byte offset of entry.
+// Lookups that don't need the offset try the dcache first.
+struct inode*
+dirlookup(struct inode *dp, char *name, uint *poff)
+{
+  uint off = 0, inum;
+
+  if(dp->type != T_DIR)
+    panic("dirlookup not DIR");
+
+  if(poff || !dclookup(dp, name, &inum)){
+    inum = dirscan(dp, name, &off);
+    dcenter(dp, name, inum);
+    if(inum && poff)
+      *poff = off;
+  }
+  if(inum == 0)
+    return 0;
+  return iget(dp->dev, inum);
+}
+
 // Write a new directory entry (name, inum) into the directory dp.
+// Returns -1 if name is present, or a hashed directory's index
+// is full.
 int
 dirlink(struct inode *dp, char *name, uint inum)
 {
-  int off;
+  int off, r;
   struct dirent de;
   struct inode *ip;
+  struct buf *root;
 
   // Check that name is not present.
   if((ip = dirlookup(dp, name, 0)) != 0){
@@ -563,6 +1495,18 @@ dirlink(struct inode *dp, char *name, uint inum)
     return -1;
   }
 
+  if(dp->size > BSIZE){
+    root = dirblock(dp, 0);
+    if(dxindexed(dp, root)){
+      r = dxlink(dp, root, name, inum);
+      brelse(root);
+      if(r == 0)
+        dcenter(dp, name, inum);
+      return r;
+    }
+    brelse(root);  // a big linear directory
+  }
+
   // Look for an empty dirent.
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
@@ -571,10 +1515,22 @@ dirlink(struct inode *dp, char *name, uint inum)
       break;
   }
 
+  if(off == BSIZE && dp->size == BSIZE){
+    // the first block is full: switch to hashing.
+    root = dirblock(dp, 0);
+    dxconvert(dp, root);
+    r = dxlink(dp, root, name, inum);
+    brelse(root);
+    if(r == 0)
+      dcenter(dp, name, inum);
+    return r;
+  }
+
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("dirlink");
+  dcenter(dp, name, inum);
 
   return 0;
 }
@@ -20,13 +20,44 @@ struct superblock {
   uint logstart;     // Block number of first log block
   uint inodestart;   // Block number of first inode block
   uint bmapstart;    // Block number of first free map block
+  uint flags;        // FS_ flags
 };
 
 #define FSMAGIC 0x10203040
+#define FS_EXTENTS 0x1  // files map their blocks with extents
 
-#define NDIRECT 12
+#define NDIRECT 10
 #define NINDIRECT (BSIZE / sizeof(uint))
-#define MAXFILE (NDIRECT + NINDIRECT)
+#define NDINDIRECT (NINDIRECT * NINDIRECT)
+#define NTINDIRECT (NDINDIRECT * NINDIRECT)
+#define MAXFILE (NDIRECT + NINDIRECT + NDINDIRECT + NTINDIRECT)
+
+// On an extent-mapped file system, a dinode holds eroot, the root
+// of a tree of extents (runs of contiguous blocks), in place of
+// addrs[].
+// A node is a header followed by entries sorted by lblk. In
+// leaves (depth 0) an entry maps len blocks starting at file
+// block lblk to disk blocks starting at start; in other nodes,
+// start is the child node covering file blocks from lblk on.
+struct extenthdr {
+  ushort n;      // entries in use
+  ushort depth;  // levels of nodes below this one
+};
+
+struct extent {
+  uint lblk;     // first file block
+  uint start;    // first disk block, or child node
+  uint len;      // number of blocks (leaves only)
+};
+
+// Extents in the root (in the dinode) and in a node block.
+#define NROOTEXT ((sizeof(uint)*(NDIRECT+3) - sizeof(struct extenthdr)) / sizeof(struct extent))
+#define NNODEEXT ((BSIZE - sizeof(struct extenthdr)) / sizeof(struct extent))
+
+struct extentroot {
+  struct extenthdr h;
+  struct extent x[NROOTEXT];
+};
 
 // On-disk inode structure
 struct dinode {
@@ -35,7 +66,10 @@ struct dinode {
   short minor;          // Minor device number (T_DEVICE only)
   short nlink;          // Number of links to inode in file system
   uint size;            // Size of file (bytes)
-  uint addrs[NDIRECT+1];   // Data block addresses
+  union {
+    uint addrs[NDIRECT+3];   // Data block addresses
+    struct extentroot eroot; // or extent tree root (FS_EXTENTS)
+  };
 };
 
 // Inodes per block.
@@ -58,3 +92,30 @@ struct dirent {
   char name[DIRSIZ];
 };
 
+
+// A directory that outgrows its first block is hashed, like
+// ext3's htree: block 0 keeps "." and "..", followed by a dxhdr
+// and dxentry's mapping name hashes to leaf blocks, either
+// directly or (levels 1) through index blocks that start with
+// a dxhdr of their own. Leaves are ordinary blocks of dirents.
+// Index slots have inum 0, so code that reads a directory as a
+// sequence of dirents just sees free entries. Names hash to even
+// numbers; an entry with an odd hash h marks a leaf that holds
+// more names with hash h-1 than fit in the leaf before it.
+#define DXMAGIC 0x4458
+
+struct dxhdr {
+  ushort inum;     // always 0
+  ushort magic;    // DXMAGIC
+  ushort levels;   // index blocks between root and leaves
+  ushort n;        // entries in use
+  uint unused[2];
+};
+
+struct dxentry {
+  ushort inum;     // always 0
+  ushort unused;
+  uint hash;       // lowest hash in the block; 0 for the first
+  uint block;      // file block number of leaf or index block
+  uint unused1;
+};
@@ -0,0 +1,325 @@
+//
+// I/O scheduler, between the buffer cache and the disk driver.
+//
+// The buffer cache queues each block it wants read or written
+// with iosubmit(). At most IODEPTH requests are at the disk at
+// once; the rest wait here, so that a policy can choose the
+// order in which they go, and requests for consecutive blocks
+// in the same direction are merged into one disk request.
+//
+// A policy is a queue with three operations: add a buf, remove
+// the buf that should go next, and remove the queued buf for a
+// given block (for merging). Two policies are provided:
+//
+// noop: first come, first served. Only merges a request with
+//   the ones queued right after it.
+// deadline: an elevator that sweeps upward through reads and
+//   writes sorted by block number. Reads go ahead of writes,
+//   which are mostly background writeback, but writes aren't
+//   passed over more than WSTARVE times in a row. A request
+//   that has waited longer than its deadline goes next.
+//
+// Build with IOSCHED=noop to pick the noop policy.
+//
+// The disk owns a buf (b->disk == 1) from iosubmit() until
+// iodone() clears b->disk and wakes up b.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "riscv.h"
+#include "defs.h"
+#include "fs.h"
+#include "buf.h"
+
+#ifndef IOSCHED
+#define IOSCHED "deadline"
+#endif
+
+#define IODEPTH 4     // max requests at the disk at once
+#define WSTARVE 2     // max reads dispatched while writes wait
+#define READ  0
+#define WRITE 1
+
+// the CLINT's timer counts about 10 cycles per microsecond.
+#define USEC 10
+
+struct iopolicy {
+  char *name;
+  void (*add)(struct buf*);
+  struct buf* (*next)(void);
+  struct buf* (*take)(uint, uint, int);
+};
+
+struct iostat {
+  uint64 nreq;    // disk requests
+  uint64 nblock;  // blocks transferred
+  uint64 total;   // sum of block latencies, in cycles
+  uint64 max;     // worst block latency
+};
+
+struct {
+  struct spinlock lock;
+  struct iopolicy *policy;
+  int inflight;             // requests at the disk
+  struct iostat stat[2];    // for reads and writes
+} ios;
+
+// cycles since boot.
+static uint64
+iotime(void)
+{
+  return *(volatile uint64*)CLINT_MTIME;
+}
+
+// noop: a single FIFO of all queued bufs.
+
+static struct {
+  struct buf *head;
+  struct buf *tail;
+} fifo;
+
+static void
+fifoadd(struct buf *b)
+{
+  b->ionext = 0;
+  if(fifo.head == 0)
+    fifo.head = b;
+  else
+    fifo.tail->ionext = b;
+  fifo.tail = b;
+}
+
+static struct buf*
+fifonext(void)
+{
+  struct buf *b = fifo.head;
+
+  if(b)
+    fifo.head = b->ionext;
+  return b;
+}
+
+static struct buf*
+fifotake(uint dev, uint blockno, int write)
+{
+  struct buf *b = fifo.head;
+
+  if(b == 0 || b->dev != dev || b->blockno != blockno || b->write != write)
+    return 0;
+  return fifonext();
+}
+
+// deadline: reads and writes in separate lists, each
+// sorted by (dev, blockno).
+
+static struct {
+  struct buf *q[2];
+  uint64 expire[2];  // deadlines, in cycles
+  uint dev;          // position of the sweep
+  uint blockno;
+  int starved;       // reads dispatched while writes waited
+} dl = {
+  .expire = { 50000*USEC, 500000*USEC },
+};
+
+static int
+before(struct buf *a, uint dev, uint blockno)
+{
+  return a->dev < dev || (a->dev == dev && a->blockno < blockno);
+}
+
+static void
+dladd(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &dl.q[b->write]; *pp && before(*pp, b->dev, b->blockno); pp = &(*pp)->ionext)
+    ;
+  b->ionext = *pp;
+  *pp = b;
+}
+
+// Remove b from its list, and continue the sweep after it.
+static struct buf*
+dlremove(struct buf *b)
+{
+  struct buf **pp;
+
+  for(pp = &dl.q[b->write]; *pp != b; pp = &(*pp)->ionext)
+    ;
+  *pp = b->ionext;
+  dl.dev = b->dev;
+  dl.blockno = b->blockno + 1;
+  return b;
+}
+
+static struct buf*
+dlnext(void)
+{
+  struct buf *b, *old;
+  int dir;
+
+  if(dl.q[READ] && (dl.q[WRITE] == 0 || dl.starved < WSTARVE)){
+    dir = READ;
+    if(dl.q[WRITE])
+      dl.starved++;
+  } else if(dl.q[WRITE]){
+    dir = WRITE;
+    dl.starved = 0;
+  } else {
+    return 0;
+  }
+
+  old = dl.q[dir];
+  for(b = dl.q[dir]; b; b = b->ionext)
+    if(b->qtime < old->qtime)
+      old = b;
+  if(iotime() - old->qtime >= dl.expire[dir])
+    return dlremove(old);
+
+  for(b = dl.q[dir]; b && before(b, dl.dev, dl.blockno); b = b->ionext)
+    ;
+  if(b == 0)
+    b = dl.q[dir];  // wrap around to the lowest block
+  return dlremove(b);
+}
+
+static struct buf*
+dltake(uint dev, uint blockno, int write)
+{
+  struct buf *b;
+
+  for(b = dl.q[write]; b && before(b, dev, blockno); b = b->ionext)
+    ;
+  if(b == 0 || b->dev != dev || b->blockno != blockno)
+    return 0;
+  return dlremove(b);
+}
+
+static struct iopolicy policies[] = {
+  { "noop", fifoadd, fifonext, fifotake },
+  { "deadline", dladd, dlnext, dltake },
+};
+
+void
+iosinit(void)
+{
+  initlock(&ios.lock, "iosched");
+  for(int i = 0; i < NELEM(policies); i++)
+    if(strncmp(policies[i].name, IOSCHED, 16) == 0)
+      ios.policy = &policies[i];
+  if(ios.policy == 0)
+    panic("iosinit: unknown policy");
+}
+
+// Send requests to the disk while it has room for them.
+// Caller must hold ios.lock.
+static void
+iodispatch(void)
+{
+  struct buf *b, *last;
+  int n, room, started = 0;
+
+  while(ios.inflight < IODEPTH && (room = virtio_disk_room()) > 0){
+    if((b = ios.policy->next()) == 0)
+      break;
+    if(room > MAXRUN)
+      room = MAXRUN;
+    last = b;
+    for(n = 1; n < room; n++){
+      last->qnext = ios.policy->take(last->dev, last->blockno+1, b->write);
+      if(last->qnext == 0)
+        break;
+      last = last->qnext;
+    }
+    last->qnext = 0;
+    ios.stat[b->write].nreq++;
+    ios.inflight++;
+    virtio_disk_start(b, b->write);
+    started = 1;
+  }
+  if(started)
+    virtio_disk_kick();  // one notification for the batch
+}
+
+// Queue the n buffers in bs to be read (write == 0) or
+// written, and return without waiting. The caller must hold
+// each buffer's lock until the request completes, except
+// that bprefetchv() lets go of buffers being read.
+void
+iosubmit(struct buf **bs, int n, int write)
+{
+  uint64 now = iotime();
+
+  acquire(&ios.lock);
+  for(int i = 0; i < n; i++){
+    bs[i]->disk = 1;
+    bs[i]->write = write;
+    bs[i]->qtime = now;
+    ios.policy->add(bs[i]);
+  }
+  iodispatch();
+  release(&ios.lock);
+}
+
+// Wait for an earlier iosubmit() of b to finish.
+void
+iowait(struct buf *b)
+{
+  acquire(&ios.lock);
+  while(b->disk)
+    sleep(b, &ios.lock);
+  release(&ios.lock);
+}
+
+// The disk has finished the request made of b and the
+// bufs linked to it by qnext. Called from the disk interrupt.
+void
+iodone(struct buf *b)
+{
+  struct iostat *st = &ios.stat[b->write];
+  uint64 now = iotime();
+  int write = b->write;
+  struct buf *nb;
+
+  acquire(&ios.lock);
+  for(; b != 0; b = nb){
+    nb = b->qnext;
+    st->nblock++;
+    st->total += now - b->qtime;
+    if(now - b->qtime > st->max)
+      st->max = now - b->qtime;
+    b->disk = 0;
+    wakeup(b);
+  }
+  ios.inflight--;
+  iodispatch();
+  release(&ios.lock);
+
+  // prefetched buffers can be recycled now.
+  if(!write)
+    bwakeup();
+}
+
+// Print request counts and latencies of each queue.
+// Runs when user types ^O on console.
+// No lock to avoid wedging a stuck machine further.
+void
+iosdump(void)
+{
+  static char *names[] = { "read", "write" };
+
+  printf("iosched %s, %d in flight\n", ios.policy->name, ios.inflight);
+  for(int i = 0; i < 2; i++){
+    struct iostat *st = &ios.stat[i];
+    if(st->nblock == 0)
+      continue;
+    printf("%s: %d requests, %d blocks, avg %d us, max %d us\n", names[i],
+           (int)st->nreq, (int)st->nblock,
+           (int)(st->total / st->nblock / USEC), (int)(st->max / USEC));
+  }
+}
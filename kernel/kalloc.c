@@ -1,6 +1,15 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU has its own free list and lock, so that CPUs
+// allocating and freeing in parallel don't contend.
+// A CPU whose list is empty steals a batch of pages
+// from another CPU's list.
+//
+// Every page carries a reference count, so that fork can
+// share pages copy-on-write. kfree drops a reference and
+// only frees the page when the last one goes away.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +18,8 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define NSTEAL 32  // max pages moved per steal
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,65 +29,201 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kmem {
   struct spinlock lock;
   struct run *freelist;
-} kmem;
+  int nfree;       // pages on freelist
+  int nsteal;      // times this CPU refilled from another CPU
+  int nstolen;     // pages this CPU took from other CPUs
+};
+
+struct kmem kmem[NCPU];
+
+// reference counts, indexed by physical page number.
+// updated with atomic instructions rather than a lock.
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+static int refcnt[(PHYSTOP - KERNBASE) / PGSIZE];
+
+static void
+kfree1(int id, struct run *r)
+{
+  acquire(&kmem[id].lock);
+  r->next = kmem[id].freelist;
+  kmem[id].freelist = r;
+  kmem[id].nfree++;
+  release(&kmem[id].lock);
+}
 
 void
 kinit()
 {
-  initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem[i].lock, "kmem");
   freerange(end, (void*)PHYSTOP);
 }
 
+// Give the initial pages to the booting CPU. The other
+// CPUs haven't started yet, and may never start if there
+// are fewer than NCPU; they steal pages as they need them.
 void
 freerange(void *pa_start, void *pa_end)
 {
   char *p;
+  int id;
+
+  push_off();
+  id = cpuid();
+  pop_off();
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
-    kfree(p);
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    memset(p, 1, PGSIZE);
+    kfree1(id, (struct run*)p);
+  }
 }
 
-// Free the page of physical memory pointed at by v,
-// which normally should have been returned by a
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  int id, n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&refcnt[PA2REF(pa)], 1);
+  if(n > 0)
+    return;
+  if(n < 0)
+    panic("kfree: refcnt");
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
-  r = (struct run*)pa;
+  push_off();
+  id = cpuid();
+  kfree1(id, (struct run*)pa);
+  pop_off();
+}
+
+// Move up to NSTEAL pages from some other CPU's free
+// list to CPU id's list. Only one kmem lock is held
+// at a time, so two CPUs stealing from each other
+// can't deadlock. Returns the number of pages moved.
+static int
+ksteal(int id)
+{
+  struct run *head, *tail;
+  int i, n, want;
+
+  for(i = 1; i < NCPU; i++){
+    struct kmem *km = &kmem[(id + i) % NCPU];
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+    acquire(&km->lock);
+    if((head = km->freelist) == 0){
+      release(&km->lock);
+      continue;
+    }
+    // take half of the victim's pages, at most NSTEAL.
+    want = (km->nfree + 1) / 2;
+    if(want > NSTEAL)
+      want = NSTEAL;
+    tail = head;
+    for(n = 1; n < want && tail->next; n++)
+      tail = tail->next;
+    km->freelist = tail->next;
+    km->nfree -= n;
+    release(&km->lock);
+
+    acquire(&kmem[id].lock);
+    tail->next = kmem[id].freelist;
+    kmem[id].freelist = head;
+    kmem[id].nfree += n;
+    kmem[id].nsteal++;
+    kmem[id].nstolen += n;
+    release(&kmem[id].lock);
+    return n;
+  }
+  return 0;
 }
 
 // Allocate one 4096-byte page of physical memory.
+// When every CPU's list is empty, takes idle pages
+// back from the page cache.
 // Returns a pointer that the kernel can use.
 // Returns 0 if the memory cannot be allocated.
 void *
 kalloc(void)
 {
   struct run *r;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  for(;;){
+    acquire(&kmem[id].lock);
+    r = kmem[id].freelist;
+    if(r){
+      kmem[id].freelist = r->next;
+      kmem[id].nfree--;
+    }
+    release(&kmem[id].lock);
+    if(r)
+      break;
+    if(ksteal(id) == 0 && pcshrink(NSTEAL) == 0)
+      break;
+  }
+  pop_off();
 
-  if(r)
+  if(r){
+    refcnt[PA2REF(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
+
+// Take another reference to an allocated page.
+void
+kdup(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("kdup");
+  if(__sync_fetch_and_add(&refcnt[PA2REF(pa)], 1) < 1)
+    panic("kdup: free page");
+}
+
+// Approximate number of free pages, for sizing caches.
+// No locks, so the count may be slightly stale.
+uint64
+kfreepages(void)
+{
+  uint64 n = 0;
+
+  for(int i = 0; i < NCPU; i++)
+    n += kmem[i].nfree;
+  return n;
+}
+
+// Number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return __sync_fetch_and_add(&refcnt[PA2REF(pa)], 0);
+}
+
+// Print per-CPU free page counts and stealing activity.
+// Runs when user types ^K on console.
+// No lock to avoid wedging a stuck machine further.
+void
+kmemdump(void)
+{
+  for(int i = 0; i < NCPU; i++){
+    if(kmem[i].nfree == 0 && kmem[i].nsteal == 0)
+      continue;
+    printf("cpu %d: %d free pages, %d steals, %d pages stolen\n",
+           i, kmem[i].nfree, kmem[i].nsteal, kmem[i].nstolen);
+  }
+}
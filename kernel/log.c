@@ -10,46 +10,107 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. A transaction is only closed when there are
+// no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
 // A system call should call begin_op()/end_op() to mark
 // its start and end. Usually begin_op() just increments
 // the count of in-progress FS system calls and returns.
-// But if it thinks the log is close to running out, it
-// sleeps until the last outstanding end_op() commits.
+// But if it thinks the log is close to running out, or the
+// open transaction has been open for COMMITTICKS, it closes
+// the transaction and sleeps until logd has taken it.
+//
+// The log is double-buffered. System calls add to the open
+// transaction (log.lh) while a kernel thread, logd, commits
+// the previous one (log.clh). When logd is idle and no system
+// call is active, it closes the open transaction by copying
+// the logged blocks out of the buffer cache into its own
+// buffers; new system calls wait only for that copy, not for
+// the disk. logd then writes the copies to the log and the
+// header. Everything that accumulates while logd is writing
+// becomes the next, larger, transaction (group commit).
+//
+// Committed blocks are written to their home locations
+// lazily (write-back). The on-disk log has two halves, used
+// by alternate transactions, so a transaction's log stays
+// valid until the one after next. Its blocks must be home
+// before then, but only those that the next transaction
+// didn't log again: a block written by every transaction
+// is absorbed by the log and never written home while the
+// writes continue. logd writes the previous transaction's
+// remaining blocks home after each commit, and a second
+// kernel thread, flushd, writes the latest transaction's
+// blocks home once the log has been idle for FLUSHTICKS, or
+// when bget() runs out of buffers. Until a committed block
+// is home, its cache buffer stays pinned, so reads see it.
 //
 // The log is a physical re-do log containing disk blocks.
-// The on-disk log format:
+// The on-disk format of each half:
 //   header block, containing block #s for block A, B, C, ...
+//     the transaction's sequence number, and a checksum
+//     of the header and blocks A, B, C, ...
 //   block A
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// logd writes the header and all the log blocks at once, in
+// any order; the transaction has committed once they are all
+// on disk. Recovery uses the checksum to tell a complete log
+// from one torn by a crash in the middle of those writes,
+// then replays the complete halves, older one first.
+
+#define COMMITTICKS 2   // max age of the open transaction under load
+#define FLUSHTICKS  30  // write back committed blocks after this long idle
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
 struct logheader {
   int n;
+  uint seq;
+  uint cksum;
   int block[LOGSIZE];
 };
 
 struct log {
   struct spinlock lock;
   int start;
-  int size;
+  int size;        // blocks in each half of the log
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int closing;     // open transaction is being handed to logd, please wait.
+  uint opened;     // ticks when the open transaction logged its first block.
   int dev;
-  struct logheader lh;
+  struct logheader lh;  // the open transaction.
+  struct logheader clh; // the transaction logd is committing.
+  uint seq;        // sequence number of the next commit
+  uint committed;  // ticks when logd last committed
+  int ndirty;      // committed blocks not yet home
+  int flushreq;    // log_flush() is waiting for flushd
+  int flushing;    // flushd is writing back
+  uint nflush;     // write-back passes flushd has finished
 };
 struct log log;
 
+// logd's copies of a transaction's blocks, and the cached
+// blocks they came from. There are two sets, used by alternate
+// transactions like the two halves of the log. A copy is dirty
+// from its commit until it is home, or until a later commit
+// logs the same block; its cached block stays pinned meanwhile.
+// The bufs are not in the buffer cache; they are used to write
+// a block's committed contents to any disk block.
+struct logset {
+  struct logheader lh;
+  struct buf buf[LOGSIZE];
+  struct buf *cached[LOGSIZE];
+  struct buf head; // header block of this half of the log
+};
+static struct logset set[2];
+static struct sleeplock setlock; // held while using set[]
+
 static void recover_from_log(void);
-static void commit();
+static void logd(void);
+static void flushd(void);
 
 void
 initlog(int dev, struct superblock *sb)
@@ -59,66 +120,137 @@ initlog(int dev, struct superblock *sb)
 
   initlock(&log.lock, "log");
   log.start = sb->logstart;
-  log.size = sb->nlog;
+  log.size = sb->nlog / 2;
   log.dev = dev;
+  initsleeplock(&setlock, "logset");
+  for(struct logset *s = set; s < set+2; s++){
+    for(int i = 0; i < LOGSIZE; i++){
+      initsleeplock(&s->buf[i].lock, "logbuf");
+      s->buf[i].dev = dev;
+    }
+    initsleeplock(&s->head.lock, "loghead");
+    s->head.dev = dev;
+  }
+
   recover_from_log();
+  kthread_create(logd, "logd");
+  kthread_create(flushd, "flushd");
 }
 
-// Copy committed blocks from log to their home location
+// First block of half h of the log.
+static int
+halfstart(int h)
+{
+  return log.start + h*log.size;
+}
+
+// Checksum (32-bit FNV-1a) of n bytes at p, continuing from h.
+static uint
+cksum(uint h, void *p, int n)
+{
+  uchar *c = p;
+
+  for(int i = 0; i < n; i++){
+    h ^= c[i];
+    h *= 16777619;
+  }
+  return h;
+}
+
+// Checksum of a transaction's header and block contents.
+static uint
+cksum_trans(struct logheader *lh, struct buf **bufs)
+{
+  uint h = 2166136261;
+
+  h = cksum(h, &lh->n, sizeof(lh->n));
+  h = cksum(h, &lh->seq, sizeof(lh->seq));
+  h = cksum(h, lh->block, lh->n * sizeof(lh->block[0]));
+  for(int i = 0; i < lh->n; i++)
+    h = cksum(h, bufs[i]->data, BSIZE);
+  return h;
+}
+
+// Copy committed blocks from half h of the log to their
+// home location. Only used by recovery.
 static void
-install_trans(void)
+install_trans(int h, struct logheader *lh)
 {
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
+  for (tail = 0; tail < lh->n; tail++) {
+    struct buf *lbuf = bread(log.dev, halfstart(h)+tail+1); // read log block
+    struct buf *dbuf = bread(log.dev, lh->block[tail]); // read dst
     memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
     bwrite(dbuf);  // write dst to disk
-    bunpin(dbuf);
     brelse(lbuf);
     brelse(dbuf);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the header of half h of the log into lh. If the half
+// doesn't hold a complete transaction, set lh->n to 0.
 static void
-read_head(void)
+read_head(int h, struct logheader *lh)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *lh = (struct logheader *) (buf->data);
+  struct buf *lbufs[LOGSIZE];
+  struct buf *buf = bread(log.dev, halfstart(h));
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
-  }
+
+  memmove(lh, buf->data, sizeof(*lh));
   brelse(buf);
+  if (lh->n <= 0 || lh->n > LOGSIZE) {
+    lh->n = 0;
+    return;
+  }
+  for (i = 0; i < lh->n; i++)
+    lbufs[i] = bread(log.dev, halfstart(h)+i+1);
+  if (cksum_trans(lh, lbufs) != lh->cksum)
+    lh->n = 0;  // torn by a crash before it committed
+  for (i = 0; i < lh->n; i++)
+    brelse(lbufs[i]);
 }
 
-// Write in-memory log header to disk.
-// This is the true point at which the
-// current transaction commits.
+// Fill s->head with s's log header, for half h of the log.
+// Caller must hold s->head.lock.
 static void
-write_head(void)
+fill_head(struct logset *s, int h)
 {
-  struct buf *buf = bread(log.dev, log.start);
-  struct logheader *hb = (struct logheader *) (buf->data);
+  struct logheader *hb = (struct logheader *) (s->head.data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+
+  memset(s->head.data, 0, BSIZE);
+  hb->n = s->lh.n;
+  hb->seq = s->lh.seq;
+  hb->cksum = s->lh.cksum;
+  for (i = 0; i < s->lh.n; i++) {
+    hb->block[i] = s->lh.block[i];
   }
-  bwrite(buf);
-  brelse(buf);
+  s->head.blockno = halfstart(h);
 }
 
 static void
 recover_from_log(void)
 {
-  read_head();
-  install_trans(); // if committed, copy from log to disk
-  log.lh.n = 0;
-  write_head(); // clear the log
+  struct logheader lh[2];
+  int h, first;
+
+  read_head(0, &lh[0]);
+  read_head(1, &lh[1]);
+  first = (lh[0].n > 0 && lh[1].n > 0 && (int)(lh[1].seq - lh[0].seq) < 0);
+  install_trans(first, &lh[first]);     // older transaction
+  install_trans(!first, &lh[!first]);   // then newer
+
+  // clear the log, older half first, so that a crash part
+  // way through never leaves just the older half to replay.
+  for (int i = 0; i < 2; i++) {
+    h = i ? !first : first;
+    acquiresleep(&set[h].head.lock);
+    fill_head(&set[h], h);
+    bwrite(&set[h].head);
+    releasesleep(&set[h].head.lock);
+  }
+  log.seq = 1;
 }
 
 // called at the start of each FS system call.
@@ -127,10 +259,13 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
-    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
-      // this op might exhaust log space; wait for commit.
+    } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE ||
+              (log.lh.n > 0 && ticks - log.opened >= COMMITTICKS)){
+      // this op might exhaust log space, or the open transaction
+      // has been open long enough; close it and wait for logd.
+      log.closing = 1;
       sleep(&log, &log.lock);
     } else {
       log.outstanding += 1;
@@ -141,19 +276,15 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// lets logd close the transaction if this was the
+// last outstanding operation.
 void
 end_op(void)
 {
-  int do_commit = 0;
-
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
   if(log.outstanding == 0){
-    do_commit = 1;
-    log.committing = 1;
+    wakeup(&log.clh);
   } else {
     // begin_op() may be waiting for log space,
     // and decrementing log.outstanding has decreased
@@ -161,49 +292,234 @@ end_op(void)
     wakeup(&log);
   }
   release(&log.lock);
+}
 
-  if(do_commit){
-    // call commit w/o holding locks, since not allowed
-    // to sleep with locks.
-    commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
+// Copy the committing transaction's blocks out of the cache.
+// They stay pinned until they are home.
+static void
+snapshot(struct logset *s)
+{
+  int tail;
+
+  for (tail = 0; tail < s->lh.n; tail++) {
+    struct buf *from = bread(log.dev, s->lh.block[tail]); // cache block
+    memmove(s->buf[tail].data, from->data, BSIZE);
+    s->cached[tail] = from;
+    brelse(from);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Write s's copies and header to its half of the log,
+// all at once. Once all have finished, the
+// transaction has committed.
 static void
-write_log(void)
+write_log(struct logset *s)
 {
+  struct buf *bufs[LOGSIZE+1];
+  int h = s - set;
   int tail;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  for (tail = 0; tail < s->lh.n; tail++)
+    bufs[tail] = &s->buf[tail];
+  s->lh.cksum = cksum_trans(&s->lh, bufs);
+
+  // the header and the copies are consecutive blocks,
+  // so they go to the disk as one request.
+  acquiresleep(&s->head.lock);
+  fill_head(s, h);
+  bufs[0] = &s->head;
+  for (tail = 0; tail < s->lh.n; tail++) {
+    acquiresleep(&s->buf[tail].lock);
+    s->buf[tail].blockno = halfstart(h)+tail+1;
+    bufs[tail+1] = &s->buf[tail];
+  }
+  bawritev(bufs, s->lh.n+1);
+
+  for (tail = 0; tail < s->lh.n; tail++) {
+    bwait(&s->buf[tail]);
+    releasesleep(&s->buf[tail].lock);
+  }
+  bwait(&s->head);
+  releasesleep(&s->head.lock);
+}
+
+// s's copy i no longer needs writing home.
+static void
+clean(struct logset *s, int i)
+{
+  s->buf[i].dirty = 0;
+  bunpin(s->cached[i]);
+  acquire(&log.lock);
+  log.ndirty--;
+  release(&log.lock);
+}
+
+// The transaction in s has committed; its copies must now be
+// written home. The previous transaction's copies of blocks
+// that s logged again are superseded.
+static void
+mark_dirty(struct logset *s, struct logset *prev)
+{
+  int i, j;
+
+  for (i = 0; i < s->lh.n; i++) {
+    s->buf[i].blockno = s->lh.block[i];
+    s->buf[i].dirty = 1;
+  }
+  acquire(&log.lock);
+  log.ndirty += s->lh.n;
+  release(&log.lock);
+
+  for (i = 0; i < prev->lh.n; i++) {
+    if (!prev->buf[i].dirty)
+      continue;
+    for (j = 0; j < s->lh.n; j++) {
+      if (s->lh.block[j] == prev->lh.block[i]) {  // absorbed
+        clean(prev, i);
+        break;
+      }
+    }
   }
 }
 
+// Write s's dirty copies home, in blockno order, all at once;
+// runs of neighboring blocks share a disk request.
+// Caller must hold setlock.
 static void
-commit()
+writeback(struct logset *s)
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
-    write_head();    // Write header to disk -- the real commit
-    install_trans(); // Now install writes to home locations
+  struct buf *bufs[LOGSIZE];
+  int i, j, n;
+
+  n = 0;
+  for (i = 0; i < s->lh.n; i++) {
+    struct buf *b = &s->buf[i];
+    if (!b->dirty)
+      continue;
+    for (j = n; j > 0 && bufs[j-1]->blockno > b->blockno; j--)
+      bufs[j] = bufs[j-1];
+    bufs[j] = b;
+    n++;
+  }
+  for (i = 0; i < n; i++)
+    acquiresleep(&bufs[i]->lock);
+  bawritev(bufs, n);
+  for (i = 0; i < n; i++) {
+    bwait(bufs[i]);
+    releasesleep(&bufs[i]->lock);
+  }
+  for (i = 0; i < s->lh.n; i++) {
+    if (s->buf[i].dirty)
+      clean(s, i);
+  }
+}
+
+// The log daemon. Waits for the open transaction to have no
+// system calls in progress, takes it over, and commits it.
+static void
+logd(void)
+{
+  struct logset *s, *prev;
+
+  acquire(&log.lock);
+  for(;;){
+    while((log.lh.n == 0 && !log.closing) || log.outstanding > 0)
+      sleep(&log.clh, &log.lock);
+
+    // close the open transaction.
+    log.closing = 1;
+    log.clh.n = log.lh.n;
+    log.clh.seq = log.seq;
+    for(int i = 0; i < log.lh.n; i++)
+      log.clh.block[i] = log.lh.block[i];
     log.lh.n = 0;
-    write_head();    // Erase the transaction from the log
+    release(&log.lock);
+
+    // the set (and log half) last used two transactions
+    // ago; everything in it is home by now.
+    s = &set[log.clh.seq % 2];
+    prev = &set[(log.clh.seq + 1) % 2];
+    acquiresleep(&setlock);
+    memmove(&s->lh, &log.clh, sizeof(s->lh));
+    snapshot(s);
+
+    // let system calls start the next transaction
+    // while this one goes to disk.
+    acquire(&log.lock);
+    log.closing = 0;
+    wakeup(&log);
+    release(&log.lock);
+
+    // call write_log w/o holding locks, since not allowed
+    // to sleep with locks.
+    if (s->lh.n > 0) {
+      write_log(s);     // the real commit
+      mark_dirty(s, prev);
+      writeback(prev);  // free prev's half for the next commit
+      acquire(&log.lock);
+      log.seq++;
+      log.committed = ticks;
+      release(&log.lock);
+    }
+    releasesleep(&setlock);
+
+    acquire(&log.lock);
+  }
+}
+
+// The flusher. Writes committed blocks home once the log has
+// been idle for FLUSHTICKS, or when log_flush() asks.
+static void
+flushd(void)
+{
+  acquire(&log.lock);
+  for(;;){
+    if(!log.flushreq){
+      if(log.ndirty == 0){
+        sleep(&log.flushreq, &log.lock);
+        continue;
+      }
+      if(ticks - log.committed < FLUSHTICKS){
+        sleep(&ticks, &log.lock);
+        continue;
+      }
+    }
+    log.flushreq = 0;
+    log.flushing = 1;
+    release(&log.lock);
+
+    acquiresleep(&setlock);
+    writeback(&set[0]);
+    writeback(&set[1]);
+    releasesleep(&setlock);
+
+    acquire(&log.lock);
+    log.flushing = 0;
+    log.nflush++;
+    wakeup(&log.nflush);
   }
 }
 
+// Have flushd write all committed blocks home, unpinning
+// their buffers, and wait until it has.
+void
+log_flush(void)
+{
+  uint n;
+
+  acquire(&log.lock);
+  // a pass already under way may have missed some blocks.
+  n = log.nflush + (log.flushing ? 2 : 1);
+  log.flushreq = 1;
+  wakeup(&log.flushreq);
+  while((int)(log.nflush - n) < 0)
+    sleep(&log.nflush, &log.lock);
+  release(&log.lock);
+}
+
 // Caller has modified b->data and is done with the buffer.
 // Record the block number and pin in the cache by increasing refcnt.
-// commit()/write_log() will do the disk write.
+// logd will do the disk write.
 //
 // log_write() replaces bwrite(); a typical use is:
 //   bp = bread(...)
@@ -227,9 +543,10 @@ log_write(struct buf *b)
   }
   log.lh.block[i] = b->blockno;
   if (i == log.lh.n) {  // Add new block to log?
+    if (i == 0)
+      log.opened = ticks;
     bpin(b);
     log.lh.n++;
   }
   release(&log.lock);
 }
-
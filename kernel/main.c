@@ -27,6 +27,9 @@ main()
     binit();         // buffer cache
     iinit();         // inode cache
     fileinit();      // file table
+    dcinit();        // directory lookup cache
+    pcinit();        // page cache
+    iosinit();       // I/O scheduler
     virtio_disk_init(); // emulated hard disk
     userinit();      // first user process
     __sync_synchronize();
@@ -0,0 +1,242 @@
+//
+// Memory-mapped files.
+//
+// Each process has a small array of VMAs, allocated
+// downwards from the trapframe. Pages are mapped on
+// first touch (see vmfault) from the page cache:
+// MAP_SHARED mappings map the cached page itself, so
+// they share changes with read and write and with each
+// other, and MAP_PRIVATE mappings map it copy-on-write.
+// Dirty pages of MAP_SHARED mappings are written back
+// to the file when they are unmapped, by munmap, exec,
+// or exit.
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "fcntl.h"
+#include "proc.h"
+
+// Return the VMA of p containing va, or 0.
+static struct vma*
+vmalookup(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && va >= v->addr && va < v->addr + v->len)
+      return v;
+  return 0;
+}
+
+// Lowest address used by p's mappings; the heap
+// may grow up to here.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0 && v->addr < base)
+      base = v->addr;
+  return base;
+}
+
+// Map len bytes of f at off into p.
+// Returns the address, or -1.
+uint64
+mmap(struct proc *p, uint64 len, int prot, int flags, struct file *f, uint off)
+{
+  struct vma *v;
+  uint64 base;
+
+  if(len == 0 || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || !f->readable)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && !f->writable)
+    return -1;
+
+  len = PGROUNDUP(len);
+  base = mmapbase(p);
+  if(len > base - PGROUNDUP(p->sz))
+    return -1;
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0){
+      v->addr = base - len;
+      v->len = len;
+      v->prot = prot;
+      v->flags = flags;
+      v->f = filedup(f);
+      v->off = off;
+      return v->addr;
+    }
+  }
+  return -1;
+}
+
+// Map the page of p's mapping at va.
+// returns 0 on success, -1 if va isn't mapped
+// for the access or memory is exhausted.
+int
+mmapfault(struct proc *p, uint64 va, int write)
+{
+  struct vma *v;
+  char *mem;
+  int perm = PTE_U;
+
+  if((v = vmalookup(p, va)) == 0)
+    return -1;
+  if(v->prot & PROT_READ)
+    perm |= PTE_R;
+  if(v->prot & PROT_WRITE)
+    perm |= PTE_R|PTE_W;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+  if(perm == PTE_U || (write && (perm & PTE_W) == 0))
+    return -1;
+
+  va = PGROUNDDOWN(va);
+  ilock(v->f->ip);
+  mem = pcget(v->f->ip, (v->off + (va - v->addr)) / PGSIZE);
+  iunlock(v->f->ip);
+  if(mem == 0)
+    return -1;
+  if(v->flags == MAP_PRIVATE && (perm & PTE_W)){
+    if(write){
+      char *copy = kalloc();
+      if(copy)
+        memmove(copy, mem, PGSIZE);
+      kfree(mem);
+      if((mem = copy) == 0)
+        return -1;
+    } else {
+      perm = (perm & ~PTE_W) | PTE_COW;
+    }
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Write the page at va of a shared mapping back to
+// its file, a few blocks per transaction like filewrite.
+// Never extends the file.
+static void
+mmapwrite(struct vma *v, uint64 va, uint64 pa)
+{
+  struct inode *ip = v->f->ip;
+  uint off = v->off + (va - v->addr);
+  int max = ((MAXOPBLOCKS-1-3-2) / 2) * BSIZE;
+  uint i, n;
+
+  for(i = 0; i < PGSIZE; i += n){
+    n = PGSIZE - i;
+    if(n > max)
+      n = max;
+    begin_op();
+    ilock(ip);
+    if(off + i >= ip->size){
+      iunlock(ip);
+      end_op();
+      break;
+    }
+    if(n > ip->size - (off + i))
+      n = ip->size - (off + i);
+    writei(ip, 0, pa + i, off + i, n);
+    iunlock(ip);
+    end_op();
+  }
+}
+
+// Unmap [addr, addr+len) from p, writing back dirty
+// shared pages. The range must lie in one mapping and
+// include its start or its end.
+int
+munmap(struct proc *p, uint64 addr, uint64 len)
+{
+  struct vma *v;
+  uint64 a;
+  pte_t *pte;
+
+  if(addr % PGSIZE != 0 || len == 0)
+    return -1;
+  if((v = vmalookup(p, addr)) == 0)
+    return -1;
+  len = PGROUNDUP(len);
+  if(addr + len < addr || addr + len > v->addr + v->len)
+    return -1;
+  if(addr != v->addr && addr + len != v->addr + v->len)
+    return -1;
+
+  for(a = addr; a < addr + len; a += PGSIZE){
+    if((pte = walk(p->pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(v->flags == MAP_SHARED && (*pte & PTE_D))
+      mmapwrite(v, a, PTE2PA(*pte));
+    uvmunmap(p->pagetable, a, 1, 1);
+  }
+
+  if(addr == v->addr){
+    v->addr += len;
+    v->off += len;
+  }
+  v->len -= len;
+  if(v->len == 0){
+    fileclose(v->f);
+    v->f = 0;
+  }
+  return 0;
+}
+
+// Unmap all of p's mappings, for exec and exit.
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->len > 0)
+      munmap(p, v->addr, v->len);
+}
+
+// Give child np the mappings of p. Pages already
+// present are shared: MAP_SHARED pages stay writable
+// in both, MAP_PRIVATE pages become copy-on-write.
+// returns 0 on success, -1 on failure.
+int
+mmapdup(struct proc *p, struct proc *np)
+{
+  int i, j;
+
+  for(i = 0; i < NVMA; i++){
+    struct vma *v = &p->vma[i];
+    if(v->len == 0)
+      continue;
+    if(uvmcopy(p->pagetable, np->pagetable, v->addr, v->len,
+               v->flags == MAP_SHARED) < 0){
+      for(j = 0; j < i; j++)
+        if(p->vma[j].len > 0)
+          uvmunmap(np->pagetable, p->vma[j].addr, p->vma[j].len/PGSIZE, 1);
+      return -1;
+    }
+  }
+  for(i = 0; i < NVMA; i++){
+    np->vma[i] = p->vma[i];
+    if(p->vma[i].len > 0)
+      filedup(p->vma[i].f);
+  }
+  return 0;
+}
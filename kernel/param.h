@@ -2,12 +2,15 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE       50  // minimum number of cached i-nodes
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
-#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       1000  // size of file system in blocks
+#define NSEG          4  // max loadable segments per program
+#define NVMA         16  // mmap regions per process
+#define MAXOPBLOCKS  12  // max # of blocks any FS op writes
+#define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in each half of the on-disk log
+#define NBUF         (MAXOPBLOCKS*12)  // size of disk block cache
+#define MAXRUN       64  // max blocks in one disk request
+#define FSSIZE       20000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
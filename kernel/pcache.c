@@ -0,0 +1,281 @@
+//
+// Page cache: file data in page-sized pieces, indexed by
+// (dev, inum, page number), above the block buffer cache.
+//
+// readi copies out of cached pages, reading the blocks of
+// a missing page through the buffer cache. writei still
+// writes each block through the buffer cache and the log,
+// and copies the new data into the cached page if there
+// is one. mmap maps cached pages directly, and so does
+// vmfault for read-only program pages, so that every
+// process running a program shares one copy of its text.
+//
+// The contents of an inode's pages are protected by the
+// inode's sleep-lock; pcache.lock only protects the hash
+// chains, the LRU list and the free headers. The cache
+// holds a reference to each of its pages (see kdup), and
+// anyone using a page holds another, so a page with a
+// count of 1 is idle and can be evicted.
+//
+// The cache grows while there is plenty of free memory,
+// recycles its own least recently used idle pages when
+// there isn't, and gives idle pages back when kalloc runs
+// out (see pcshrink).
+//
+
+#include "types.h"
+#include "riscv.h"
+#include "defs.h"
+#include "param.h"
+#include "memlayout.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "buf.h"
+#include "file.h"
+
+#define NPCACHE 4096  // max cached pages
+#define NPCHASH 127
+#define PCHASH(dev, inum, pgno) (((dev)*31+(inum)*17+(pgno))%NPCHASH)
+// don't grow the cache if it would leave fewer free pages than this.
+#define PCRESERVE ((PHYSTOP - KERNBASE) / PGSIZE / 8)
+
+struct page {
+  uint dev;
+  uint inum;
+  uint pgno;
+  char *pa;
+  struct page *hnext;  // hash chain, or free list
+  struct page *prev;   // LRU list, most recently used first
+  struct page *next;
+};
+
+struct {
+  struct spinlock lock;
+  struct page page[NPCACHE];
+  struct page *hash[NPCHASH];
+  struct page *free;
+  struct page lru;     // head of LRU list
+} pcache;
+
+void
+pcinit(void)
+{
+  struct page *pg;
+
+  initlock(&pcache.lock, "pcache");
+  pcache.lru.prev = &pcache.lru;
+  pcache.lru.next = &pcache.lru;
+  for(pg = pcache.page; pg < &pcache.page[NPCACHE]; pg++){
+    pg->hnext = pcache.free;
+    pcache.free = pg;
+  }
+}
+
+static struct page*
+pclookup(uint dev, uint inum, uint pgno)
+{
+  struct page *pg;
+
+  for(pg = pcache.hash[PCHASH(dev, inum, pgno)]; pg; pg = pg->hnext)
+    if(pg->dev == dev && pg->inum == inum && pg->pgno == pgno)
+      return pg;
+  return 0;
+}
+
+static void
+lrufront(struct page *pg)
+{
+  pg->prev->next = pg->next;
+  pg->next->prev = pg->prev;
+  pg->next = pcache.lru.next;
+  pg->prev = &pcache.lru;
+  pcache.lru.next->prev = pg;
+  pcache.lru.next = pg;
+}
+
+// Remove pg from the cache and put its header on the
+// free list. Returns its page, still holding the
+// cache's reference.
+static char*
+pcremove(struct page *pg)
+{
+  struct page **pp;
+  char *pa = pg->pa;
+
+  for(pp = &pcache.hash[PCHASH(pg->dev, pg->inum, pg->pgno)]; *pp; pp = &(*pp)->hnext){
+    if(*pp == pg){
+      *pp = pg->hnext;
+      break;
+    }
+  }
+  pg->prev->next = pg->next;
+  pg->next->prev = pg->prev;
+  pg->pa = 0;
+  pg->hnext = pcache.free;
+  pcache.free = pg;
+  return pa;
+}
+
+// Evict the least recently used idle page, and return
+// it for reuse, or 0 if every page is busy.
+static char*
+pcevict(void)
+{
+  struct page *pg;
+
+  for(pg = pcache.lru.prev; pg != &pcache.lru; pg = pg->prev)
+    if(krefcnt(pg->pa) == 1)
+      return pcremove(pg);
+  return 0;
+}
+
+// Start reading the blocks of ip's pages pgno..pgno+n-1
+// that aren't cached into the buffer cache, so that the
+// disk works on all of them at once; neighboring blocks
+// share a disk request. Caller must hold ip->lock.
+static void
+pcprefetch(struct inode *ip, uint pgno, uint n)
+{
+  uint blocks[MAXRUN];
+  uint bn;
+  int k = 0, cached;
+
+  for(; n > 0 && pgno * PGSIZE < ip->size; pgno++, n--){
+    acquire(&pcache.lock);
+    cached = pclookup(ip->dev, ip->inum, pgno) != 0;
+    release(&pcache.lock);
+    if(cached)
+      continue;
+    for(bn = pgno * (PGSIZE/BSIZE); bn < (pgno+1) * (PGSIZE/BSIZE); bn++){
+      if(bn * BSIZE >= ip->size)
+        break;
+      if(k == MAXRUN){
+        bprefetchv(ip->dev, blocks, k);
+        k = 0;
+      }
+      blocks[k++] = bmap(ip, bn);
+    }
+  }
+  if(k > 0)
+    bprefetchv(ip->dev, blocks, k);
+}
+
+// Return a page of ip's data at page number pgno, with
+// a reference for the caller, who releases it with kfree.
+// Reads the page in if it isn't cached; bytes beyond the
+// end of the file are zero, and pages entirely beyond it
+// aren't cached. Returns 0 if out of memory.
+// Caller must hold ip->lock.
+char*
+pcget(struct inode *ip, uint pgno)
+{
+  struct page *pg;
+  struct buf *bp;
+  char *mem = 0;
+  uint bn;
+
+  acquire(&pcache.lock);
+  if((pg = pclookup(ip->dev, ip->inum, pgno)) != 0){
+    kdup(pg->pa);
+    lrufront(pg);
+    release(&pcache.lock);
+    return pg->pa;
+  }
+  if(kfreepages() < PCRESERVE || pcache.free == 0)
+    mem = pcevict();
+  release(&pcache.lock);
+
+  if(mem == 0 && (mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  pcprefetch(ip, pgno, 1);
+  for(bn = pgno * (PGSIZE/BSIZE); bn < (pgno+1) * (PGSIZE/BSIZE); bn++){
+    if(bn * BSIZE >= ip->size)
+      break;
+    bp = bread(ip->dev, bmap(ip, bn));
+    memmove(mem + (bn * BSIZE) % PGSIZE, bp->data, BSIZE);
+    brelse(bp);
+  }
+
+  // no one else can have cached this page meanwhile,
+  // since we hold ip->lock.
+  if(pgno * PGSIZE >= ip->size)
+    return mem;
+  acquire(&pcache.lock);
+  if((pg = pcache.free) != 0){
+    pcache.free = pg->hnext;
+    pg->dev = ip->dev;
+    pg->inum = ip->inum;
+    pg->pgno = pgno;
+    pg->pa = mem;
+    pg->hnext = pcache.hash[PCHASH(ip->dev, ip->inum, pgno)];
+    pcache.hash[PCHASH(ip->dev, ip->inum, pgno)] = pg;
+    pg->next = pg->prev = pg;
+    lrufront(pg);
+    kdup(mem);
+  }
+  release(&pcache.lock);
+  return mem;
+}
+
+// Copy n bytes that writei just wrote at off into ip's
+// cached page, if there is one. Caller must hold ip->lock.
+void
+pcwrite(struct inode *ip, uint off, char *src, uint n)
+{
+  struct page *pg;
+  char *pa;
+
+  acquire(&pcache.lock);
+  if((pg = pclookup(ip->dev, ip->inum, off / PGSIZE)) == 0){
+    release(&pcache.lock);
+    return;
+  }
+  pa = pg->pa;
+  kdup(pa);
+  release(&pcache.lock);
+  memmove(pa + off % PGSIZE, src, n);
+  kfree(pa);
+}
+
+// Drop ip's cached pages, because it is being truncated.
+// Only pages below ip->size are ever cached.
+// Pages that are mapped stay with their mappings.
+// Caller must hold ip->lock.
+void
+pcinval(struct inode *ip)
+{
+  struct page *pg;
+  uint pgno;
+
+  acquire(&pcache.lock);
+  for(pgno = 0; pgno * PGSIZE < ip->size; pgno++)
+    if((pg = pclookup(ip->dev, ip->inum, pgno)) != 0)
+      kfree(pcremove(pg));
+  release(&pcache.lock);
+}
+
+// Free up to n idle pages, for kalloc when memory runs
+// out. Returns the number freed.
+int
+pcshrink(int n)
+{
+  char *pa;
+  int i;
+
+  acquire(&pcache.lock);
+  for(i = 0; i < n && (pa = pcevict()) != 0; i++)
+    kfree(pa);
+  release(&pcache.lock);
+  return i;
+}
+
+// Start reading n pages of ip from page pgno in the
+// background, skipping pages that are already cached.
+// Caller must hold ip->lock.
+void
+pcreadahead(struct inode *ip, uint pgno, uint n)
+{
+  pcprefetch(ip, pgno, n);
+}
@@ -8,11 +8,13 @@
 #include "sleeplock.h"
 #include "file.h"
 
-#define PIPESIZE 512
+#define PIPESIZE PGSIZE  // data is a page of its own
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
 
 struct pipe {
   struct spinlock lock;
-  char data[PIPESIZE];
+  char *data;     // ring of PIPESIZE bytes
   uint nread;     // number of bytes read
   uint nwrite;    // number of bytes written
   int readopen;   // read fd is still open
@@ -30,6 +32,8 @@ pipealloc(struct file **f0, struct file **f1)
     goto bad;
   if((pi = (struct pipe*)kalloc()) == 0)
     goto bad;
+  if((pi->data = kalloc()) == 0)
+    goto bad;
   pi->readopen = 1;
   pi->writeopen = 1;
   pi->nwrite = 0;
@@ -46,6 +50,8 @@ pipealloc(struct file **f0, struct file **f1)
   return 0;
 
  bad:
+  if(pi && pi->data)
+    kfree(pi->data);
   if(pi)
     kfree((char*)pi);
   if(*f0)
@@ -68,33 +74,40 @@ pipeclose(struct pipe *pi, int writable)
   }
   if(pi->readopen == 0 && pi->writeopen == 0){
     release(&pi->lock);
+    kfree(pi->data);
     kfree((char*)pi);
   } else
     release(&pi->lock);
 }
 
+// Copy whole runs of bytes at a time, each run ending at the end
+// of the user's buffer, the end of the data, or the end of the ring.
+// Wake up the other side only if it could be waiting: readers sleep
+// only on an empty pipe, and writers only on a full one.
 int
 pipewrite(struct pipe *pi, uint64 addr, int n)
 {
   int i;
-  char ch;
+  uint m;
   struct proc *pr = myproc();
 
   acquire(&pi->lock);
-  for(i = 0; i < n; i++){
+  for(i = 0; i < n; i += m){
     while(pi->nwrite == pi->nread + PIPESIZE){  //DOC: pipewrite-full
       if(pi->readopen == 0 || pr->killed){
         release(&pi->lock);
         return -1;
       }
-      wakeup(&pi->nread);
       sleep(&pi->nwrite, &pi->lock);
     }
-    if(copyin(pr->pagetable, &ch, addr + i, 1) == -1)
+    m = min(n - i, PIPESIZE - (pi->nwrite - pi->nread));
+    m = min(m, PIPESIZE - pi->nwrite % PIPESIZE);
+    if(copyin(pr->pagetable, &pi->data[pi->nwrite % PIPESIZE], addr + i, m) == -1)
       break;
-    pi->data[pi->nwrite++ % PIPESIZE] = ch;
+    if(pi->nwrite == pi->nread)
+      wakeup(&pi->nread);
+    pi->nwrite += m;
   }
-  wakeup(&pi->nread);
   release(&pi->lock);
   return i;
 }
@@ -103,8 +116,8 @@ int
 piperead(struct pipe *pi, uint64 addr, int n)
 {
   int i;
+  uint m;
   struct proc *pr = myproc();
-  char ch;
 
   acquire(&pi->lock);
   while(pi->nread == pi->nwrite && pi->writeopen){  //DOC: pipe-empty
@@ -114,14 +127,17 @@ piperead(struct pipe *pi, uint64 addr, int n)
     }
     sleep(&pi->nread, &pi->lock); //DOC: piperead-sleep
   }
-  for(i = 0; i < n; i++){  //DOC: piperead-copy
+  for(i = 0; i < n; i += m){  //DOC: piperead-copy
     if(pi->nread == pi->nwrite)
       break;
-    ch = pi->data[pi->nread++ % PIPESIZE];
-    if(copyout(pr->pagetable, addr + i, &ch, 1) == -1)
+    m = min(n - i, pi->nwrite - pi->nread);
+    m = min(m, PIPESIZE - pi->nread % PIPESIZE);
+    if(copyout(pr->pagetable, addr + i, &pi->data[pi->nread % PIPESIZE], m) == -1)
       break;
+    if(pi->nwrite == pi->nread + PIPESIZE)
+      wakeup(&pi->nwrite);  //DOC: piperead-wakeup
+    pi->nread += m;
   }
-  wakeup(&pi->nwrite);  //DOC: piperead-wakeup
   release(&pi->lock);
   return i;
 }
@@ -15,7 +15,25 @@ struct proc *initproc;
 int nextpid = 1;
 struct spinlock pid_lock;
 
+// Sleeping processes, hashed by the channel they sleep on,
+// so that wakeup() only looks at processes that might be
+// sleeping on its channel. A process is on the wait queue
+// of p->chan from just before it releases the caller's lock
+// in sleep() until it runs again. p->chan doesn't change
+// while it is on a wait queue, except that wakeup() clears
+// it once it has woken the process.
+#define NWAITQ 61
+#define NWAKE 8   // sleepers woken per pass over a wait queue
+#define WQHASH(chan) (((uint64)(chan) >> 3) % NWAITQ)
+
+struct waitq {
+  struct spinlock lock;
+  struct proc *head;  // linked through p->wqnext
+  uint64 nsleep;      // sleeps so far; orders them against wakeups
+} waitq[NWAITQ];
+
 extern void forkret(void);
+static void kthreadret(void);
 static void wakeup1(struct proc *chan);
 static void freeproc(struct proc *p);
 
@@ -28,6 +46,10 @@ procinit(void)
   struct proc *p;
   
   initlock(&pid_lock, "nextpid");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&cpus[i].rqlock, "runq");
+  for(int i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
 
@@ -85,6 +107,45 @@ allocpid() {
   return pid;
 }
 
+// Mark p RUNNABLE and add it to the tail of the run queue
+// of the cpu it last ran on.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct cpu *c = &cpus[p->cpu];
+
+  if(!holding(&p->lock))
+    panic("setrunnable");
+  p->state = RUNNABLE;
+  acquire(&c->rqlock);
+  p->rqnext = 0;
+  if(c->rqtail)
+    c->rqtail->rqnext = p;
+  else
+    c->rqhead = p;
+  c->rqtail = p;
+  release(&c->rqlock);
+}
+
+// Remove and return the process at the head of c's run queue,
+// or 0 if there is none.
+static struct proc*
+runqpop(struct cpu *c)
+{
+  struct proc *p;
+
+  acquire(&c->rqlock);
+  if((p = c->rqhead) != 0){
+    c->rqhead = p->rqnext;
+    if(c->rqhead == 0)
+      c->rqtail = 0;
+    p->rqnext = 0;
+  }
+  release(&c->rqlock);
+  return p;
+}
+
 // Look in the process table for an UNUSED proc.
 // If found, initialize state required to run in the kernel,
 // and return with p->lock held.
@@ -146,6 +207,8 @@ freeproc(struct proc *p)
   p->pid = 0;
   p->parent = 0;
   p->name[0] = 0;
+  p->kthread = 0;
+  p->nseg = 0;
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
@@ -228,25 +291,49 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  setrunnable(p);
+
+  release(&p->lock);
+}
+
+// Start a kernel thread that runs fn(), which must not return.
+// A kernel thread has no user memory, no parent, and never
+// returns to user space; it runs until the machine stops.
+void
+kthread_create(void (*fn)(void), char *name)
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    panic("kthread_create");
+
+  p->kthread = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  setrunnable(p);
 
   release(&p->lock);
 }
 
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; the pages are
+// allocated on first touch by vmfault().
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
 {
-  uint sz;
+  uint64 sz;
   struct proc *p = myproc();
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
+    if(-(uint64)n > sz)  // not -n, which overflows for INT_MIN
+      return -1;
     sz = uvmdealloc(p->pagetable, sz, sz + n);
   }
   p->sz = sz;
@@ -268,12 +355,17 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  np->sz = p->sz;  // so freeproc() unmaps the copy on failure
+  if(mmapdup(p, np) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
-  np->sz = p->sz;
 
   np->parent = p;
 
@@ -288,12 +380,18 @@ fork(void)
     if(p->ofile[i])
       np->ofile[i] = filedup(p->ofile[i]);
   np->cwd = idup(p->cwd);
+  if(p->exe)
+    np->exe = idup(p->exe);
+  np->nseg = p->nseg;
+  memmove(np->seg, p->seg, sizeof(p->seg));
 
   safestrcpy(np->name, p->name, sizeof(p->name));
 
   pid = np->pid;
 
-  np->state = RUNNABLE;
+  // start out on the parent's cpu.
+  np->cpu = cpuid();
+  setrunnable(np);
 
   release(&np->lock);
 
@@ -337,6 +435,8 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -348,8 +448,11 @@ exit(int status)
 
   begin_op();
   iput(p->cwd);
+  if(p->exe)
+    iput(p->exe);
   end_op();
   p->cwd = 0;
+  p->exe = 0;
 
   // we might re-parent a child to init. we can't be precise about
   // waking up init, since we can't acquire its lock once we've
@@ -401,6 +504,10 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout below happens under p->lock.
+  if(addr != 0)
+    vmprefault(p, addr, sizeof(int));
+
   // hold p->lock for the whole time to avoid lost
   // wakeups from a child's exit().
   acquire(&p->lock);
@@ -449,7 +556,8 @@ wait(uint64 addr)
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run: the oldest on this CPU's
+//    run queue, or else one taken from another CPU's queue.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -458,35 +566,37 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
-    
-    int found = 0;
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-
-        found = 1;
-      }
-      release(&p->lock);
-    }
-    if(found == 0) {
+
+    p = runqpop(c);
+    for(int i = 1; p == 0 && i < NCPU; i++)
+      p = runqpop(&cpus[(id + i) % NCPU]);
+    if(p == 0) {
       intr_on();
       asm volatile("wfi");
+      continue;
+    }
+
+    acquire(&p->lock);
+    if(p->state == RUNNABLE) {
+      // Switch to chosen process.  It is the process's job
+      // to release its lock and then reacquire it
+      // before jumping back to us.
+      p->state = RUNNING;
+      p->cpu = id;
+      c->proc = p;
+      swtch(&c->context, &p->context);
+
+      // Process is done running for now.
+      // It should have changed its p->state before coming back.
+      c->proc = 0;
     }
+    release(&p->lock);
   }
 }
 
@@ -523,7 +633,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -549,31 +659,60 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+
+  p->kthread();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  struct waitq *wq = &waitq[WQHASH(chan)];
+  struct proc **pp;
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
-  // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // Once we hold p->lock and are on chan's
+  // wait queue, we can be guaranteed that we
+  // won't miss any wakeup (wakeup finds us on
+  // the queue and then locks p->lock),
   // so it's okay to release lk.
   if(lk != &p->lock){  //DOC: sleeplock0
     acquire(&p->lock);  //DOC: sleeplock1
+  }
+  p->chan = chan;
+  acquire(&wq->lock);
+  p->wqseq = wq->nsleep++;
+  p->wqnext = wq->head;
+  wq->head = p;
+  release(&wq->lock);
+  if(lk != &p->lock){
     release(lk);
   }
 
   // Go to sleep.
-  p->chan = chan;
   p->state = SLEEPING;
 
   sched();
 
   // Tidy up.
+  acquire(&wq->lock);
+  for(pp = &wq->head; *pp != p; pp = &(*pp)->wqnext)
+    ;
+  *pp = p->wqnext;
+  release(&wq->lock);
   p->chan = 0;
 
   // Reacquire original lock.
@@ -585,18 +724,46 @@ sleep(void *chan, struct spinlock *lk)
 
 // Wake up all processes sleeping on chan.
 // Must be called without any p->lock.
+// Collects a batch of sleepers and locks them after
+// releasing the wait queue lock, since sleep() takes
+// the wait queue lock while holding p->lock. Woken
+// processes get p->chan cleared, so that the next pass
+// only finds the rest. Only processes that went to
+// sleep before wakeup() was called count, so that ones
+// that wake up and sleep again on chan don't keep it
+// going.
 void
 wakeup(void *chan)
 {
-  struct proc *p;
+  struct waitq *wq = &waitq[WQHASH(chan)];
+  struct proc *p, *batch[NWAKE];
+  uint64 seq;
+  int i, n;
+
+  acquire(&wq->lock);
+  seq = wq->nsleep;
+  release(&wq->lock);
+
+  do {
+    n = 0;
+    acquire(&wq->lock);
+    for(p = wq->head; p != 0 && n < NWAKE; p = p->wqnext){
+      if(p->chan == chan && p->wqseq < seq)
+        batch[n++] = p;
+    }
+    release(&wq->lock);
 
-  for(p = proc; p < &proc[NPROC]; p++) {
-    acquire(&p->lock);
-    if(p->state == SLEEPING && p->chan == chan) {
-      p->state = RUNNABLE;
+    for(i = 0; i < n; i++){
+      p = batch[i];
+      acquire(&p->lock);
+      if(p->chan == chan && p->wqseq < seq){
+        if(p->state == SLEEPING)
+          setrunnable(p);
+        p->chan = 0;
+      }
+      release(&p->lock);
     }
-    release(&p->lock);
-  }
+  } while(n == NWAKE);
 }
 
 // Wake up p if it is sleeping in wait(); used by exit().
@@ -607,7 +774,7 @@ wakeup1(struct proc *p)
   if(!holding(&p->lock))
     panic("wakeup1");
   if(p->chan == p && p->state == SLEEPING) {
-    p->state = RUNNABLE;
+    setrunnable(p);
   }
 }
 
@@ -625,7 +792,7 @@ kill(int pid)
       p->killed = 1;
       if(p->state == SLEEPING){
         // Wake process from sleep().
-        p->state = RUNNABLE;
+        setrunnable(p);
       }
       release(&p->lock);
       return 0;
@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  struct spinlock rqlock;     // protects rqhead and rqtail
+  struct proc *rqhead;        // RUNNABLE processes waiting for this cpu,
+  struct proc *rqtail;        //   oldest first, linked through p->rqnext
 };
 
 extern struct cpu cpus[NCPU];
@@ -82,6 +85,26 @@ struct trapframe {
 
 enum procstate { UNUSED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
+// A loadable program segment, filled in on demand
+// from the process's executable.
+struct seg {
+  uint64 va;     // start address, page-aligned
+  uint64 memsz;  // bytes of memory
+  uint off;      // offset in executable
+  uint filesz;   // bytes of memory initialized from the file
+  int perm;      // PTE_R, PTE_W, PTE_X
+};
+
+// A file mapped with mmap.
+struct vma {
+  uint64 addr;     // start address, page-aligned
+  uint64 len;      // bytes, page-aligned; 0 if unused
+  int prot;        // PROT_READ, PROT_WRITE, PROT_EXEC
+  int flags;       // MAP_SHARED or MAP_PRIVATE
+  struct file *f;
+  uint off;        // file offset of addr
+};
+
 // Per-process state
 struct proc {
   struct spinlock lock;
@@ -90,9 +113,13 @@ struct proc {
   enum procstate state;        // Process state
   struct proc *parent;         // Parent process
   void *chan;                  // If non-zero, sleeping on chan
+  struct proc *wqnext;         // Next process on chan's wait queue
+  uint64 wqseq;                // When it joined the wait queue
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int cpu;                     // Run queue to put process on when RUNNABLE
+  struct proc *rqnext;         // Next process on the same run queue
 
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
@@ -103,4 +130,9 @@ struct proc {
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
   char name[16];               // Process name (debugging)
+  struct inode *exe;           // Executable, for demand paging
+  int nseg;                    // Number of entries in seg
+  struct seg seg[NSEG];        // Segments of exe
+  struct vma vma[NVMA];        // Memory-mapped files
+  void (*kthread)(void);       // If non-zero, kernel thread entry point
 };
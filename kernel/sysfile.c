@@ -218,6 +218,7 @@ sys_unlink(void)
   memset(&de, 0, sizeof(de));
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
+  dcenter(dp, name, 0);
   if(ip->type == T_DIR){
     dp->nlink--;
     iupdate(dp);
@@ -275,8 +276,18 @@ create(char *path, short type, short major, short minor)
       panic("create dots");
   }
 
-  if(dirlink(dp, name, ip->inum) < 0)
-    panic("create: dirlink");
+  if(dirlink(dp, name, ip->inum) < 0){
+    // dp's index is full.
+    if(type == T_DIR){
+      dp->nlink--;
+      iupdate(dp);
+    }
+    ip->nlink = 0;
+    iupdate(ip);
+    iunlockput(ip);
+    iunlockput(dp);
+    return 0;
+  }
 
   iunlockput(dp);
 
@@ -336,6 +347,7 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->raoff = f->rapg = f->rawin = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -484,3 +496,29 @@ sys_pipe(void)
   }
   return 0;
 }
+
+uint64
+sys_mmap(void)
+{
+  uint64 addr, len, off;
+  int prot, flags;
+  struct file *f;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0 || argint(2, &prot) < 0 ||
+     argint(3, &flags) < 0 || argfd(4, 0, &f) < 0 || argaddr(5, &off) < 0)
+    return -1;
+  // the address is only a hint, and ignored.
+  if(off != (uint)off)
+    return -1;
+  return mmap(myproc(), len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  if(argaddr(0, &addr) < 0 || argaddr(1, &len) < 0)
+    return -1;
+  return munmap(myproc(), addr, len);
+}
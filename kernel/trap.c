@@ -65,6 +65,9 @@ usertrap(void)
     intr_on();
 
     syscall();
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p, r_stval(), r_scause() == 15) == 0){
+    // page fault on a lazily allocated or copy-on-write page
   } else if((which_dev = devintr()) != 0){
     // ok
   } else {
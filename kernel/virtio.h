@@ -43,9 +43,10 @@
 #define VIRTIO_RING_F_INDIRECT_DESC 28
 #define VIRTIO_RING_F_EVENT_IDX     29
 
-// this many virtio descriptors.
+// at most this many virtio descriptors; the driver uses the
+// largest power of two that the device also supports.
 // must be a power of two.
-#define NUM 8
+#define NUM 256
 
 struct VRingDesc {
   uint64 addr;
@@ -55,6 +56,11 @@ struct VRingDesc {
 };
 #define VRING_DESC_F_NEXT  1 // chained with another descriptor
 #define VRING_DESC_F_WRITE 2 // device writes (vs read)
+#define VRING_DESC_F_INDIRECT 4 // addr is a table of descriptors
+
+// at most this many indirect descriptor tables, each big
+// enough for a request of MAXRUN blocks.
+#define NTABLE 16
 
 struct VRingUsedElem {
   uint32 id;   // index of start of completed descriptor chain
@@ -65,6 +71,20 @@ struct VRingUsedElem {
 #define VIRTIO_BLK_T_IN  0 // read the disk
 #define VIRTIO_BLK_T_OUT 1 // write the disk
 
+// the format of the first descriptor in a disk request.
+// to be followed by two more descriptors containing
+// the block, and a one-byte status.
+struct virtio_blk_req {
+  uint32 type; // VIRTIO_BLK_T_IN or ..._OUT
+  uint32 reserved;
+  uint64 sector;
+};
+
+// the used ring. without VIRTIO_RING_F_EVENT_IDX, flags may
+// say the device needs no notifications; with it, the device
+// puts avail_event after the last of the queue's elems[].
+#define VRING_USED_F_NO_NOTIFY 1
+
 struct UsedArea {
   uint16 flags;
   uint16 id;
@@ -25,27 +25,61 @@ static struct disk {
  // this is a global instead of allocated because it must
  // be multiple contiguous pages, which kalloc()
  // doesn't support, and page aligned.
-  char pages[2*PGSIZE];
+ // descriptors and the avail ring come first; the used
+ // ring starts at the next page boundary after them.
+  char pages[3*PGSIZE];
   struct VRingDesc *desc;
   uint16 *avail;
   struct UsedArea *used;
 
   // our own book-keeping.
-  char free[NUM];  // is a descriptor free?
-  uint16 used_idx; // we've looked this far in used[2..NUM].
+  uint32 num;         // negotiated queue size, a power of two <= NUM.
+  uint16 freelist[NUM]; // stack of free descriptor indices.
+  int nfree;          // number of entries on freelist.
+  uint16 used_idx;    // we've looked this far in used->elems[].
+  uint16 kicked;      // avail[1] when the device was last notified.
+  int indirect;       // negotiated VIRTIO_RING_F_INDIRECT_DESC?
+  int eventidx;       // negotiated VIRTIO_RING_F_EVENT_IDX?
+
+  // indirect descriptor tables, so that a request needs
+  // only one ring descriptor however many blocks it has.
+  struct VRingDesc table[NTABLE][MAXRUN+2];
+  uint8 tfreelist[NTABLE]; // stack of free table indices.
+  int ntfree;
 
   // track info about in-flight operations,
   // for use when completion interrupt arrives.
   // indexed by first descriptor index of chain.
   struct {
-    struct buf *b;
+    struct buf *b;  // first of the request's bufs, linked by qnext
+    int table;      // indirect table, or -1
     char status;
   } info[NUM];
+
+  // disk command headers.
+  // one-for-one with descriptors, for convenience.
+  struct virtio_blk_req ops[NUM];
   
   struct spinlock vdisk_lock;
   
 } __attribute__ ((aligned (PGSIZE))) disk;
 
+// with VIRTIO_RING_F_EVENT_IDX, the driver asks for an
+// interrupt once the device's used index passes used_event,
+// and the device asks for a notification once avail[1]
+// passes avail_event.
+static volatile uint16*
+used_event(void)
+{
+  return &disk.avail[2 + disk.num];
+}
+
+static volatile uint16*
+avail_event(void)
+{
+  return (uint16*) &disk.used->elems[disk.num];
+}
+
 void
 virtio_disk_init(void)
 {
@@ -73,9 +107,11 @@ virtio_disk_init(void)
   features &= ~(1 << VIRTIO_BLK_F_CONFIG_WCE);
   features &= ~(1 << VIRTIO_BLK_F_MQ);
   features &= ~(1 << VIRTIO_F_ANY_LAYOUT);
-  features &= ~(1 << VIRTIO_RING_F_EVENT_IDX);
-  features &= ~(1 << VIRTIO_RING_F_INDIRECT_DESC);
+  // keep VIRTIO_RING_F_INDIRECT_DESC and VIRTIO_RING_F_EVENT_IDX
+  // if the device offers them.
   *R(VIRTIO_MMIO_DRIVER_FEATURES) = features;
+  disk.indirect = (features & (1 << VIRTIO_RING_F_INDIRECT_DESC)) != 0;
+  disk.eventidx = (features & (1 << VIRTIO_RING_F_EVENT_IDX)) != 0;
 
   // tell device that feature negotiation is complete.
   status |= VIRTIO_CONFIG_S_FEATURES_OK;
@@ -88,26 +124,39 @@ virtio_disk_init(void)
   *R(VIRTIO_MMIO_GUEST_PAGE_SIZE) = PGSIZE;
 
   // initialize queue 0.
+  // use as many descriptors as both we and the device allow.
   *R(VIRTIO_MMIO_QUEUE_SEL) = 0;
   uint32 max = *R(VIRTIO_MMIO_QUEUE_NUM_MAX);
   if(max == 0)
     panic("virtio disk has no queue 0");
-  if(max < NUM)
+  disk.num = NUM;
+  while(disk.num > max)
+    disk.num /= 2;
+  if(disk.num < 3)
     panic("virtio disk max queue too short");
-  *R(VIRTIO_MMIO_QUEUE_NUM) = NUM;
+  *R(VIRTIO_MMIO_QUEUE_NUM) = disk.num;
+  *R(VIRTIO_MMIO_QUEUE_ALIGN) = PGSIZE;
   memset(disk.pages, 0, sizeof(disk.pages));
   *R(VIRTIO_MMIO_QUEUE_PFN) = ((uint64)disk.pages) >> PGSHIFT;
 
   // desc = pages -- num * VRingDesc
-  // avail = pages + 0x40 -- 2 * uint16, then num * uint16
-  // used = pages + 4096 -- 2 * uint16, then num * vRingUsedElem
+  // avail = pages + num*16 -- 2 * uint16, then num * uint16, then used_event
+  // used = next page boundary -- 2 * uint16, then num * vRingUsedElem,
+  //   then avail_event
 
   disk.desc = (struct VRingDesc *) disk.pages;
-  disk.avail = (uint16*)(((char*)disk.desc) + NUM*sizeof(struct VRingDesc));
-  disk.used = (struct UsedArea *) (disk.pages + PGSIZE);
-
-  for(int i = 0; i < NUM; i++)
-    disk.free[i] = 1;
+  disk.avail = (uint16*)(((char*)disk.desc) + disk.num*sizeof(struct VRingDesc));
+  disk.used = (struct UsedArea *)
+    (disk.pages + PGROUNDUP(disk.num*sizeof(struct VRingDesc) + (3+disk.num)*sizeof(uint16)));
+  if((char*)(avail_event() + 1) > disk.pages + sizeof(disk.pages))
+    panic("virtio disk ring too big");
+
+  disk.nfree = 0;
+  for(int i = disk.num - 1; i >= 0; i--)
+    disk.freelist[disk.nfree++] = i;
+  disk.ntfree = 0;
+  for(int i = NTABLE - 1; i >= 0; i--)
+    disk.tfreelist[disk.ntfree++] = i;
 
   // plic.c and trap.c arrange for interrupts from VIRTIO0_IRQ.
 }
@@ -116,26 +165,21 @@ virtio_disk_init(void)
 static int
 alloc_desc()
 {
-  for(int i = 0; i < NUM; i++){
-    if(disk.free[i]){
-      disk.free[i] = 0;
-      return i;
-    }
-  }
-  return -1;
+  if(disk.nfree == 0)
+    return -1;
+  return disk.freelist[--disk.nfree];
 }
 
 // mark a descriptor as free.
 static void
 free_desc(int i)
 {
-  if(i >= NUM)
+  if(i >= disk.num)
     panic("virtio_disk_intr 1");
-  if(disk.free[i])
+  if(disk.nfree >= disk.num)
     panic("virtio_disk_intr 2");
   disk.desc[i].addr = 0;
-  disk.free[i] = 1;
-  wakeup(&disk.free[0]);
+  disk.freelist[disk.nfree++] = i;
 }
 
 // free a chain of descriptors.
@@ -143,128 +187,203 @@ static void
 free_chain(int i)
 {
   while(1){
+    int flag = disk.desc[i].flags;
+    int nxt = disk.desc[i].next;
     free_desc(i);
-    if(disk.desc[i].flags & VRING_DESC_F_NEXT)
-      i = disk.desc[i].next;
+    if(flag & VRING_DESC_F_NEXT)
+      i = nxt;
     else
       break;
   }
 }
 
-static int
-alloc3_desc(int *idx)
+// How many blocks a request started now could carry.
+// Caller must keep concurrent starts from racing for the
+// descriptors, as iosched.c does with its lock.
+int
+virtio_disk_room(void)
 {
-  for(int i = 0; i < 3; i++){
-    idx[i] = alloc_desc();
-    if(idx[i] < 0){
-      for(int j = 0; j < i; j++)
-        free_desc(idx[j]);
-      return -1;
-    }
-  }
-  return 0;
+  int n;
+
+  acquire(&disk.vdisk_lock);
+  if(disk.indirect && disk.nfree > 0 && disk.ntfree > 0)
+    n = MAXRUN;  // one ring descriptor and an indirect table
+  else
+    n = (disk.nfree < disk.num ? disk.nfree : disk.num) - 2;
+  release(&disk.vdisk_lock);
+  return n;
+}
+
+// Fill in a descriptor.
+static void
+setdesc(struct VRingDesc *d, void *addr, uint32 len, uint16 flags, uint16 next)
+{
+  d->addr = (uint64) addr;
+  d->len = len;
+  d->flags = flags;
+  d->next = next;
 }
 
+// Start a read or write of b and the bufs linked to it by
+// qnext, which must hold consecutive blocks and be no more
+// than virtio_disk_room(), as one request, and return
+// without waiting for it to finish. The device only hears
+// of it at the next virtio_disk_kick(). virtio_disk_intr()
+// passes the request to iodone() when it completes.
 void
-virtio_disk_rw(struct buf *b, int write)
+virtio_disk_start(struct buf *b, int write)
 {
-  uint64 sector = b->blockno * (BSIZE / 512);
+  struct VRingDesc *tab;
+  struct buf *bp;
+  uint16 dflags;
+  int n, d, prev;
 
   acquire(&disk.vdisk_lock);
 
-  // the spec says that legacy block operations use three
-  // descriptors: one for type/reserved/sector, one for
-  // the data, one for a 1-byte status result.
+  // the spec says that legacy block operations use a
+  // descriptor for type/reserved/sector, then the data,
+  // then a 1-byte status result. the data may be spread
+  // over several descriptors, one per block.
+  // if the device takes indirect descriptors, they go in
+  // a table, and the ring holds a single descriptor
+  // pointing at it.
 
-  // allocate the three descriptors.
-  int idx[3];
-  while(1){
-    if(alloc3_desc(idx) == 0) {
-      break;
-    }
-    sleep(&disk.free[0], &disk.vdisk_lock);
-  }
-  
-  // format the three descriptors.
+  // format the descriptors.
   // qemu's virtio-blk.c reads them.
 
-  struct virtio_blk_outhdr {
-    uint32 type;
-    uint32 reserved;
-    uint64 sector;
-  } buf0;
+  int first = alloc_desc();
+  if(first < 0)
+    panic("virtio_disk_start");
+  struct virtio_blk_req *buf0 = &disk.ops[first];
 
   if(write)
-    buf0.type = VIRTIO_BLK_T_OUT; // write the disk
+    buf0->type = VIRTIO_BLK_T_OUT; // write the disk
   else
-    buf0.type = VIRTIO_BLK_T_IN; // read the disk
-  buf0.reserved = 0;
-  buf0.sector = sector;
-
-  // buf0 is on a kernel stack, which is not direct mapped,
-  // thus the call to kvmpa().
-  disk.desc[idx[0]].addr = (uint64) kvmpa((uint64) &buf0);
-  disk.desc[idx[0]].len = sizeof(buf0);
-  disk.desc[idx[0]].flags = VRING_DESC_F_NEXT;
-  disk.desc[idx[0]].next = idx[1];
-
-  disk.desc[idx[1]].addr = (uint64) b->data;
-  disk.desc[idx[1]].len = BSIZE;
+    buf0->type = VIRTIO_BLK_T_IN; // read the disk
+  buf0->reserved = 0;
+  buf0->sector = b->blockno * (BSIZE / 512);
+
   if(write)
-    disk.desc[idx[1]].flags = 0; // device reads b->data
+    dflags = 0; // device reads b->data
   else
-    disk.desc[idx[1]].flags = VRING_DESC_F_WRITE; // device writes b->data
-  disk.desc[idx[1]].flags |= VRING_DESC_F_NEXT;
-  disk.desc[idx[1]].next = idx[2];
-
-  disk.info[idx[0]].status = 0;
-  disk.desc[idx[2]].addr = (uint64) &disk.info[idx[0]].status;
-  disk.desc[idx[2]].len = 1;
-  disk.desc[idx[2]].flags = VRING_DESC_F_WRITE; // device writes the status
-  disk.desc[idx[2]].next = 0;
+    dflags = VRING_DESC_F_WRITE; // device writes b->data
+  disk.info[first].status = 0xff; // device writes 0 on success
+
+  if(disk.indirect && disk.ntfree > 0){
+    int t = disk.tfreelist[--disk.ntfree];
+    tab = disk.table[t];
+    n = 0;
+    setdesc(&tab[n], buf0, sizeof(struct virtio_blk_req), VRING_DESC_F_NEXT, n+1);
+    n++;
+    for(bp = b; bp != 0; bp = bp->qnext){
+      setdesc(&tab[n], bp->data, BSIZE, dflags | VRING_DESC_F_NEXT, n+1);
+      n++;
+    }
+    setdesc(&tab[n], &disk.info[first].status, 1, VRING_DESC_F_WRITE, 0);
+    n++;
+    setdesc(&disk.desc[first], tab, n*sizeof(struct VRingDesc), VRING_DESC_F_INDIRECT, 0);
+    disk.info[first].table = t;
+  } else {
+    setdesc(&disk.desc[first], buf0, sizeof(struct virtio_blk_req), VRING_DESC_F_NEXT, 0);
+    prev = first;
+    for(bp = b; bp != 0; bp = bp->qnext){
+      if((d = alloc_desc()) < 0)
+        panic("virtio_disk_start");
+      disk.desc[prev].next = d;
+      setdesc(&disk.desc[d], bp->data, BSIZE, dflags | VRING_DESC_F_NEXT, 0);
+      prev = d;
+    }
+    if((d = alloc_desc()) < 0)
+      panic("virtio_disk_start");
+    disk.desc[prev].next = d;
+    setdesc(&disk.desc[d], &disk.info[first].status, 1, VRING_DESC_F_WRITE, 0);
+    disk.info[first].table = -1;
+  }
 
-  // record struct buf for virtio_disk_intr().
-  b->disk = 1;
-  disk.info[idx[0]].b = b;
+  // record the bufs for virtio_disk_intr().
+  disk.info[first].b = b;
 
   // avail[0] is flags
   // avail[1] tells the device how far to look in avail[2...].
   // avail[2...] are desc[] indices the device should process.
   // we only tell device the first index in our chain of descriptors.
-  disk.avail[2 + (disk.avail[1] % NUM)] = idx[0];
+  disk.avail[2 + (disk.avail[1] % disk.num)] = first;
   __sync_synchronize();
   disk.avail[1] = disk.avail[1] + 1;
+  __sync_synchronize();
 
-  *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
-
-  // Wait for virtio_disk_intr() to say request has finished.
-  while(b->disk == 1) {
-    sleep(b, &disk.vdisk_lock);
-  }
+  release(&disk.vdisk_lock);
+}
 
-  disk.info[idx[0]].b = 0;
-  free_chain(idx[0]);
+// Tell the device about the requests started since the last
+// kick, unless it has said that it doesn't need to know yet.
+// Called once after starting a batch of requests.
+void
+virtio_disk_kick(void)
+{
+  int notify;
 
+  acquire(&disk.vdisk_lock);
+  uint16 old = disk.kicked;
+  uint16 new = disk.avail[1];
+  disk.kicked = new;
+  __sync_synchronize();
+  if(old == new)
+    notify = 0;
+  else if(disk.eventidx)  // did avail[1] pass avail_event?
+    notify = (uint16)(new - *avail_event() - 1) < (uint16)(new - old);
+  else
+    notify = (disk.used->flags & VRING_USED_F_NO_NOTIFY) == 0;
+  if(notify)
+    *R(VIRTIO_MMIO_QUEUE_NOTIFY) = 0; // value is queue number
   release(&disk.vdisk_lock);
 }
 
 void
 virtio_disk_intr()
 {
-  acquire(&disk.vdisk_lock);
+  struct buf *b;
+
+  // the device won't raise another interrupt until we tell it
+  // we've seen this interrupt, which the following line does.
+  // this may race with the device writing new entries to
+  // the "used" ring, in which case we may process the new
+  // completion entries in this interrupt, and have nothing to do
+  // in the next interrupt, which is harmless.
+  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
 
-  while((disk.used_idx % NUM) != (disk.used->id % NUM)){
-    int id = disk.used->elems[disk.used_idx].id;
+  __sync_synchronize();
+
+  // the device increments disk.used->id when it
+  // adds an entry to the used ring.
+  // iodone() may start more requests, so call it
+  // without holding vdisk_lock.
+  while(1){
+    acquire(&disk.vdisk_lock);
+    if(disk.used_idx == disk.used->id && disk.eventidx){
+      // ask for an interrupt at the next completion, then
+      // look again in case one slipped in meanwhile.
+      *used_event() = disk.used_idx;
+      __sync_synchronize();
+    }
+    if(disk.used_idx == disk.used->id){
+      release(&disk.vdisk_lock);
+      break;
+    }
+    __sync_synchronize();
+    int id = disk.used->elems[disk.used_idx % disk.num].id;
 
     if(disk.info[id].status != 0)
       panic("virtio_disk_intr status");
-    
-    disk.info[id].b->disk = 0;   // disk is done with buf
-    wakeup(disk.info[id].b);
 
-    disk.used_idx = (disk.used_idx + 1) % NUM;
-  }
-  *R(VIRTIO_MMIO_INTERRUPT_ACK) = *R(VIRTIO_MMIO_INTERRUPT_STATUS) & 0x3;
+    b = disk.info[id].b;
+    disk.info[id].b = 0;
+    if(disk.info[id].table >= 0)
+      disk.tfreelist[disk.ntfree++] = disk.info[id].table;
+    free_chain(id);
+    disk.used_idx += 1;
+    release(&disk.vdisk_lock);
 
-  release(&disk.vdisk_lock);
+    iodone(b);  // disk is done with the bufs
+  }
 }
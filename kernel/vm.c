@@ -5,6 +5,8 @@
 #include "riscv.h"
 #include "defs.h"
 #include "fs.h"
+#include "spinlock.h"
+#include "proc.h"
 
 /*
  * the kernel's page table.
@@ -180,10 +182,11 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
+    // lazily allocated pages may never have been touched.
     if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -299,42 +302,176 @@ uvmfree(pagetable_t pagetable, uint64 sz)
   freewalk(pagetable);
 }
 
-// Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// Given a parent process's page table, copy its
+// memory in [va, va+sz) into a child's page table.
+// Copies only the page table: the child shares the
+// parent's physical pages. Unless share is set,
+// writable pages are marked copy-on-write in both
+// page tables.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 va, uint64 sz, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
+  for(i = va; i < va + sz; i += PGSIZE){
     if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
+      continue;
     if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+      continue;
+    if(!share && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
     flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
-      goto err;
-    }
+    kdup((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, va, (i - va) / PGSIZE, 1);
   return -1;
 }
 
+// Make the copy-on-write page at va writable, giving
+// the page table its own copy of the page unless no
+// one else shares it any more.
+// returns 0 on success, -1 if va isn't a copy-on-write
+// page or there's no memory for the copy.
+int
+cowcopy(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  if((pte = walk(pagetable, PGROUNDDOWN(va), 0)) == 0)
+    return -1;
+  if((*pte & (PTE_V|PTE_U|PTE_COW)) != (PTE_V|PTE_U|PTE_COW))
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+  if(krefcnt((void*)pa) == 1){
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault by process p at va.
+// Program and heap pages are allocated on first touch,
+// program pages filled from the executable. Read-only
+// program pages are shared with the page cache. Pages
+// above p->sz belong to mmap (see mmapfault). Writes
+// to copy-on-write pages get a private copy.
+// returns 0 if the fault was handled, -1 if va
+// is not a valid address for the access.
+int
+vmfault(struct proc *p, uint64 va, int write)
+{
+  pte_t *pte;
+  char *mem;
+  struct seg *s;
+  int perm = PTE_W|PTE_X|PTE_R;
+  uint n = 0;
+
+  if(va >= MAXVA)
+    return -1;
+  va = PGROUNDDOWN(va);
+  pte = walk(p->pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    if(write && (*pte & PTE_COW))
+      return cowcopy(p->pagetable, va);
+    return -1;
+  }
+  if(va >= p->sz)
+    return mmapfault(p, va, write);
+
+  for(s = p->seg; s < &p->seg[p->nseg]; s++)
+    if(va >= s->va && va < s->va + s->memsz)
+      break;
+  if(s < &p->seg[p->nseg]){
+    perm = s->perm;
+    if(write && (perm & PTE_W) == 0)
+      return -1;
+    if(va - s->va < s->filesz)
+      n = s->filesz - (va - s->va);
+    if(n > PGSIZE)
+      n = PGSIZE;
+  }
+
+  // a read-only page that is a whole page of the file can
+  // map the page cache's copy. a partial last page gets a
+  // private copy, since the rest of it must read as zeros,
+  // not as whatever follows the segment in the file.
+  if(n == PGSIZE && (perm & PTE_W) == 0 && (s->off + (va - s->va)) % PGSIZE == 0){
+    ilock(p->exe);
+    mem = pcget(p->exe, (s->off + (va - s->va)) / PGSIZE);
+    iunlock(p->exe);
+    if(mem == 0)
+      return -1;
+  } else {
+    if((mem = kalloc()) == 0)
+      return -1;
+    memset(mem, 0, PGSIZE);
+    if(n > 0){
+      ilock(p->exe);
+      if(readi(p->exe, 0, (uint64)mem, s->off + (va - s->va), n) != n){
+        iunlock(p->exe);
+        kfree(mem);
+        return -1;
+      }
+      iunlock(p->exe);
+    }
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)mem, perm|PTE_U) != 0){
+    kfree(mem);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the pages of [va, va+len) that p must read
+// from a file. That may sleep, so kernel code that copies
+// to or from user memory while holding a spinlock or an
+// inode lock calls this first.
+void
+vmprefault(struct proc *p, uint64 va, uint64 len)
+{
+  struct seg *s;
+  struct vma *v;
+  uint64 a, end;
+
+  if(va + len < va)
+    len = -va;
+  for(s = p->seg; s < &p->seg[p->nseg]; s++){
+    a = va > s->va ? va : s->va;
+    end = va + len < s->va + s->filesz ? va + len : s->va + s->filesz;
+    for(a = PGROUNDDOWN(a); a < end; a += PGSIZE)
+      vmfault(p, a, 0);
+  }
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->len == 0)
+      continue;
+    a = va > v->addr ? va : v->addr;
+    end = va + len < v->addr + v->len ? va + len : v->addr + v->len;
+    for(a = PGROUNDDOWN(a); a < end; a += PGSIZE)
+      vmfault(p, a, 0);
+  }
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -348,6 +485,28 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Look up the physical address of user page va0 for
+// copyin/copyout, faulting it in if pagetable belongs
+// to the current process. Writes need a writable page,
+// and mark it dirty.
+// returns 0 on failure.
+static uint64
+uvmaddr(pagetable_t pagetable, uint64 va0, int write)
+{
+  struct proc *p = myproc();
+  uint64 pa0;
+
+  pa0 = walkaddr(pagetable, va0);
+  if(pa0 == 0 || (write && (*walk(pagetable, va0, 0) & PTE_W) == 0)){
+    if(p == 0 || p->pagetable != pagetable || vmfault(p, va0, write) != 0)
+      return 0;
+    pa0 = walkaddr(pagetable, va0);
+  }
+  if(write)
+    *walk(pagetable, va0, 0) |= PTE_D;  // for mmap write-back
+  return pa0;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
 // Return 0 on success, -1 on error.
@@ -358,7 +517,7 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 1);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (dstva - va0);
@@ -383,7 +542,7 @@ copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
@@ -410,7 +569,7 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
+    pa0 = uvmaddr(pagetable, va0, 0);
     if(pa0 == 0)
       return -1;
     n = PGSIZE - (srcva - va0);
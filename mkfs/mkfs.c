@@ -22,7 +22,7 @@
 
 int nbitmap = FSSIZE/(BSIZE*8) + 1;
 int ninodeblocks = NINODES / IPB + 1;
-int nlog = LOGSIZE;
+int nlog = 2*(LOGSIZE+1);  // two halves: header + LOGSIZE blocks
 int nmeta;    // Number of meta blocks (boot, sb, nlog, inode, bitmap)
 int nblocks;  // Number of data blocks
 
@@ -31,6 +31,7 @@ struct superblock sb;
 char zeroes[BSIZE];
 uint freeinode = 1;
 uint freeblock;
+int extents;  // -e: map file blocks with extents
 
 
 void balloc(int);
@@ -76,8 +77,14 @@ main(int argc, char *argv[])
 
   static_assert(sizeof(int) == 4, "Integers must be 4 bytes!");
 
+  if(argc > 1 && strcmp(argv[1], "-e") == 0){
+    extents = 1;
+    argc--;
+    argv++;
+  }
+
   if(argc < 2){
-    fprintf(stderr, "Usage: mkfs fs.img files...\n");
+    fprintf(stderr, "Usage: mkfs [-e] fs.img files...\n");
     exit(1);
   }
 
@@ -102,6 +109,7 @@ main(int argc, char *argv[])
   sb.logstart = xint(2);
   sb.inodestart = xint(2+nlog);
   sb.bmapstart = xint(2+nlog+ninodeblocks);
+  sb.flags = xint(extents ? FS_EXTENTS : 0);
 
   printf("nmeta %d (boot, super, log blocks %u inode blocks %u, bitmap blocks %u) blocks %d total %d\n",
          nmeta, nlog, ninodeblocks, nbitmap, nblocks, FSSIZE);
@@ -260,6 +268,32 @@ balloc(int used)
 
 #define min(a, b) ((a) < (b) ? (a) : (b))
 
+// Return the disk block of block fbn of an extent-mapped inode,
+// allocating it if fbn is just past the end. mkfs only builds
+// roots of NROOTEXT extents, plenty for the files it copies.
+uint
+emap(struct dinode *din, uint fbn)
+{
+  struct extenthdr *h = &din->eroot.h;
+  struct extent *x = din->eroot.x;
+  int i, n = xshort(h->n);
+
+  for(i = 0; i < n; i++){
+    if(fbn >= xint(x[i].lblk) && fbn < xint(x[i].lblk) + xint(x[i].len))
+      return xint(x[i].start) + fbn - xint(x[i].lblk);
+  }
+  if(n > 0 && xint(x[n-1].start) + xint(x[n-1].len) == freeblock){
+    x[n-1].len = xint(xint(x[n-1].len) + 1);
+  } else {
+    assert(n < NROOTEXT);
+    x[n].lblk = xint(fbn);
+    x[n].start = xint(freeblock);
+    x[n].len = xint(1);
+    h->n = xshort(n + 1);
+  }
+  return freeblock++;
+}
+
 void
 iappend(uint inum, void *xp, int n)
 {
@@ -268,7 +302,8 @@ iappend(uint inum, void *xp, int n)
   struct dinode din;
   char buf[BSIZE];
   uint indirect[NINDIRECT];
-  uint x;
+  uint x, bn, nb, div;
+  int level;
 
   rinode(inum, &din);
   off = xint(din.size);
@@ -276,21 +311,35 @@ iappend(uint inum, void *xp, int n)
   while(n > 0){
     fbn = off / BSIZE;
     assert(fbn < MAXFILE);
-    if(fbn < NDIRECT){
+    if(extents){
+      x = emap(&din, fbn);
+    } else if(fbn < NDIRECT){
       if(xint(din.addrs[fbn]) == 0){
         din.addrs[fbn] = xint(freeblock++);
       }
       x = xint(din.addrs[fbn]);
     } else {
-      if(xint(din.addrs[NDIRECT]) == 0){
-        din.addrs[NDIRECT] = xint(freeblock++);
+      // walk down the indirect blocks like bmap().
+      bn = fbn - NDIRECT;
+      nb = NINDIRECT;
+      div = 1;
+      for(level = 0; bn >= nb; level++){
+        bn -= nb;
+        nb *= NINDIRECT;
+        div *= NINDIRECT;
+      }
+      if(xint(din.addrs[NDIRECT+level]) == 0){
+        din.addrs[NDIRECT+level] = xint(freeblock++);
       }
-      rsect(xint(din.addrs[NDIRECT]), (char*)indirect);
-      if(indirect[fbn - NDIRECT] == 0){
-        indirect[fbn - NDIRECT] = xint(freeblock++);
-        wsect(xint(din.addrs[NDIRECT]), (char*)indirect);
+      x = xint(din.addrs[NDIRECT+level]);
+      for(; div > 0; div /= NINDIRECT){
+        rsect(x, (char*)indirect);
+        if(indirect[bn / div % NINDIRECT] == 0){
+          indirect[bn / div % NINDIRECT] = xint(freeblock++);
+          wsect(x, (char*)indirect);
+        }
+        x = xint(indirect[bn / div % NINDIRECT]);
       }
-      x = xint(indirect[fbn-NDIRECT]);
     }
     n1 = min(n, (fbn + 1) * BSIZE - off);
     rsect(x, buf);
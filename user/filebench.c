@@ -0,0 +1,55 @@
+// Measure sequential write and read throughput of a large file.
+// usage: filebench [MB]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define CHUNK (8*1024)
+
+char buf[CHUNK];
+
+int
+main(int argc, char *argv[])
+{
+  int mb = 4;
+  int i, n, fd, t0, t1;
+
+  if(argc > 1)
+    mb = atoi(argv[1]);
+  n = mb * (1024*1024 / CHUNK);
+  memset(buf, 'f', CHUNK);
+
+  unlink("filebench.tmp");
+  fd = open("filebench.tmp", O_CREATE|O_WRONLY);
+  if(fd < 0){
+    fprintf(2, "filebench: create failed\n");
+    exit(1);
+  }
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(write(fd, buf, CHUNK) != CHUNK){
+      fprintf(2, "filebench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+  t1 = uptime();
+  printf("filebench: write %dMB: %d ticks\n", mb, t1 - t0);
+
+  fd = open("filebench.tmp", O_RDONLY);
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    if(read(fd, buf, CHUNK) != CHUNK){
+      fprintf(2, "filebench: read failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+  t1 = uptime();
+  printf("filebench: read %dMB: %d ticks\n", mb, t1 - t0);
+
+  unlink("filebench.tmp");
+  exit(0);
+}
@@ -0,0 +1,53 @@
+// Measure fork latency for processes of increasing size.
+// usage: forkbench [nfork]
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define MB (1024*1024)
+
+int
+main(int argc, char *argv[])
+{
+  int nfork = 100;
+  int sizes[] = { 0, 1*MB, 4*MB, 16*MB };
+  char *a, *p;
+  int i, j, pid, t0, t1;
+
+  if(argc > 1)
+    nfork = atoi(argv[1]);
+
+  for(i = 0; i < sizeof(sizes)/sizeof(sizes[0]); i++){
+    a = sbrk(sizes[i]);
+    if(a == (char*)-1){
+      fprintf(2, "forkbench: sbrk failed\n");
+      exit(1);
+    }
+    // touch the memory so that it's really allocated.
+    for(p = a; p < a + sizes[i]; p += 4096)
+      *p = 1;
+
+    t0 = uptime();
+    for(j = 0; j < nfork; j++){
+      pid = fork();
+      if(pid < 0){
+        fprintf(2, "forkbench: fork failed\n");
+        exit(1);
+      }
+      if(pid == 0){
+        // dirty one page, like a child about to exec would.
+        if(sizes[i] > 0)
+          *(a + sizes[i] / 2) = 2;
+        exit(0);
+      }
+      wait(0);
+    }
+    t1 = uptime();
+    printf("forkbench: %d forks of a %dKB heap: %d ticks\n",
+           nfork, sizes[i] / 1024, t1 - t0);
+
+    sbrk(-sizes[i]);
+  }
+  exit(0);
+}
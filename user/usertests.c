@@ -523,9 +523,11 @@ writetest(char *s)
   }
 }
 
+// a file of a few MB, reaching into the doubly-indirect blocks.
 void
 writebig(char *s)
 {
+  enum { NBIG = NDIRECT + NINDIRECT + 16*NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -534,7 +536,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", i);
@@ -554,7 +556,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBIG){
         printf("%s: read only %d blocks from big", n);
         exit(1);
       }
@@ -577,6 +579,73 @@ writebig(char *s)
   }
 }
 
+// files grown a block at a time in turn, so that their
+// blocks interleave. on an extent file system (make
+// EXTENTS=1) that takes one extent per block, more than
+// fit in a tree of depth one. truncating them frees the
+// trees, and the second round grows them again in the
+// freed blocks.
+void
+fragfile(char *s)
+{
+  enum { NF = 4, N = NROOTEXT*NNODEEXT + 40 };
+  int fd[NF], i, j, round;
+  char name[3];
+
+  name[0] = 'f';
+  name[2] = '\0';
+  for(round = 0; round < 2; round++){
+    for(j = 0; j < NF; j++){
+      name[1] = '0' + j;
+      fd[j] = open(name, O_CREATE|O_TRUNC|O_RDWR);
+      if(fd[j] < 0){
+        printf("%s: create %s failed\n", s, name);
+        exit(1);
+      }
+    }
+    for(i = 0; i < N; i++){
+      for(j = 0; j < NF; j++){
+        ((int*)buf)[0] = i;
+        ((int*)buf)[1] = round*NF + j;
+        if(write(fd[j], buf, BSIZE) != BSIZE){
+          printf("%s: write block %d failed\n", s, i);
+          exit(1);
+        }
+      }
+    }
+    for(j = 0; j < NF; j++){
+      close(fd[j]);
+      name[1] = '0' + j;
+      if((fd[j] = open(name, O_RDONLY)) < 0){
+        printf("%s: open %s failed\n", s, name);
+        exit(1);
+      }
+      for(i = 0; i < N; i++){
+        if(read(fd[j], buf, BSIZE) != BSIZE){
+          printf("%s: read block %d of %s failed\n", s, i, name);
+          exit(1);
+        }
+        if(((int*)buf)[0] != i || ((int*)buf)[1] != round*NF + j){
+          printf("%s: block %d of %s is wrong\n", s, i, name);
+          exit(1);
+        }
+      }
+      if(read(fd[j], buf, BSIZE) != 0){
+        printf("%s: %s too long\n", s, name);
+        exit(1);
+      }
+      close(fd[j]);
+    }
+  }
+  for(j = 0; j < NF; j++){
+    name[1] = '0' + j;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -1479,6 +1548,121 @@ bigdir(char *s)
   }
 }
 
+// a directory big enough to need index blocks: links, lookups,
+// unlinks, reading it as plain dirents, and removing it.
+void
+hashdir(char *s)
+{
+  enum { N = 4000 };
+  struct dirent de;
+  char name[8];
+  int i, fd, n;
+
+  if(mkdir("hd") != 0 || (fd = open("hd/f", O_CREATE)) < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  name[0] = 'h';
+  name[1] = 'd';
+  name[2] = '/';
+  name[7] = 0;
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 1000;
+    name[4] = '0' + i / 100 % 10;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if(link("hd/f", name) != 0){
+      printf("%s: link %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i += 2){
+    name[3] = 'a' + i / 1000;
+    name[4] = '0' + i / 100 % 10;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    if(unlink(name) != 0){
+      printf("%s: unlink %s failed\n", s, name);
+      exit(1);
+    }
+  }
+  for(i = 0; i < N; i++){
+    name[3] = 'a' + i / 1000;
+    name[4] = '0' + i / 100 % 10;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    fd = open(name, O_RDONLY);
+    if((fd >= 0) != (i % 2 == 1)){
+      printf("%s: open %s gave %d\n", s, name, fd);
+      exit(1);
+    }
+    if(fd >= 0)
+      close(fd);
+  }
+
+  // ".", "..", "f", and the odd links.
+  fd = open("hd", O_RDONLY);
+  n = 0;
+  while(read(fd, &de, sizeof(de)) == sizeof(de))
+    if(de.inum != 0)
+      n++;
+  close(fd);
+  if(n != 3 + N/2){
+    printf("%s: read %d entries, not %d\n", s, n, 3 + N/2);
+    exit(1);
+  }
+
+  for(i = 1; i < N; i += 2){
+    name[3] = 'a' + i / 1000;
+    name[4] = '0' + i / 100 % 10;
+    name[5] = '0' + i / 10 % 10;
+    name[6] = '0' + i % 10;
+    unlink(name);
+  }
+  if(unlink("hd") == 0){
+    printf("%s: removed non-empty hd\n", s);
+    exit(1);
+  }
+  if(unlink("hd/f") != 0 || unlink("hd") != 0){
+    printf("%s: remove hd failed\n", s);
+    exit(1);
+  }
+}
+
+// names that come and go, in a directory that comes and goes,
+// must not be remembered wrongly by the lookup cache.
+void
+dcache(char *s)
+{
+  int i, fd;
+
+  for(i = 0; i < 3; i++){
+    if(open("dc/x", O_RDONLY) >= 0){
+      printf("%s: opened dc/x before creating it\n", s);
+      exit(1);
+    }
+    if(mkdir("dc") != 0 || (fd = open("dc/x", O_CREATE|O_RDWR)) < 0){
+      printf("%s: create dc/x failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if((fd = open("dc/x", O_RDONLY)) < 0){
+      printf("%s: open dc/x failed\n", s);
+      exit(1);
+    }
+    close(fd);
+    if(unlink("dc/x") != 0 || open("dc/x", O_RDONLY) >= 0){
+      printf("%s: dc/x still there after unlink\n", s);
+      exit(1);
+    }
+    if(unlink("dc") != 0){
+      printf("%s: unlink dc failed\n", s);
+      exit(1);
+    }
+  }
+}
+
 void
 subdir(char *s)
 {
@@ -2016,6 +2200,412 @@ sbrkbasic(char *s)
   exit(xstatus);
 }
 
+// reads served from the page cache must see every write,
+// including writes that extend or truncate the file.
+void
+pagecache(char *s)
+{
+  enum { SZ = 2*4096 + 100 };
+  char *file = "pagecache";
+  char *scratch;
+  int fd, i;
+
+  scratch = malloc(SZ + 1);
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  // read it in, then overwrite a byte in the middle.
+  fd = open(file, O_RDWR);
+  if(read(fd, scratch, 4000) != 4000 || write(fd, "x", 1) != 1){
+    printf("%s: overwrite failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  buf[4000] = 'x';
+
+  // read it all, then append.
+  fd = open(file, O_RDWR);
+  if(read(fd, scratch, SZ + 1) != SZ || memcmp(scratch, buf, SZ) != 0){
+    printf("%s: overwrite not seen\n", s);
+    exit(1);
+  }
+  if(write(fd, "y", 1) != 1){
+    printf("%s: append failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  buf[SZ] = 'y';
+
+  fd = open(file, O_RDONLY);
+  if(read(fd, scratch, SZ + 1) != SZ + 1 || memcmp(scratch, buf, SZ + 1) != 0){
+    printf("%s: append not seen\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open(file, O_RDWR|O_TRUNC);
+  if(read(fd, scratch, 1) != 0){
+    printf("%s: read after truncate returned data\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+  free(scratch);
+}
+
+// Overwrite one block many times, and write many files
+// quickly, so committed blocks pile up waiting to go home.
+void
+writeback(char *s)
+{
+  enum { NW = 200, NF = 40 };
+  char name[4];
+  int fd, i, j, v;
+
+  for(i = 0; i < NW; i++){
+    fd = open("wb", O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, &i, sizeof(i)) != sizeof(i)){
+      printf("%s: overwrite failed\n", s);
+      exit(1);
+    }
+    close(fd);
+  }
+  fd = open("wb", O_RDONLY);
+  if(read(fd, &v, sizeof(v)) != sizeof(v) || v != NW-1){
+    printf("%s: read back %d, not %d\n", s, v, NW-1);
+    exit(1);
+  }
+  close(fd);
+  unlink("wb");
+
+  name[0] = 'w';
+  name[2] = 'b';
+  name[3] = 0;
+  for(i = 0; i < NF; i++){
+    name[1] = '0' + i;
+    memset(buf, i, BSIZE);
+    fd = open(name, O_CREATE|O_RDWR);
+    if(fd < 0 || write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write %s failed\n", s, name);
+      exit(1);
+    }
+    close(fd);
+  }
+  for(i = 0; i < NF; i++){
+    name[1] = '0' + i;
+    fd = open(name, O_RDONLY);
+    if(fd < 0 || read(fd, buf, BSIZE) != BSIZE){
+      printf("%s: read %s failed\n", s, name);
+      exit(1);
+    }
+    for(j = 0; j < BSIZE; j++){
+      if(buf[j] != (char)i){
+        printf("%s: %s has wrong data\n", s, name);
+        exit(1);
+      }
+    }
+    close(fd);
+    unlink(name);
+  }
+}
+
+// readers of cold files and a writer keep the disk busy at
+// the same time. all of them must finish, under either I/O
+// scheduler policy (make IOSCHED=noop, or the default
+// deadline): reads mustn't starve writes, nor the reverse.
+void
+iosched(char *s)
+{
+  enum { NR = 2, N = 200, T = 300 };
+  int fd, i, j, pid, dog, xstatus, pids[NR+1];
+  char name[3];
+
+  // written but never read, so the readers' blocks mostly
+  // come from the disk rather than the caches.
+  name[0] = 'r';
+  name[2] = 0;
+  for(j = 0; j < NR; j++){
+    name[1] = '0' + j;
+    if((fd = open(name, O_CREATE|O_RDWR)) < 0){
+      printf("%s: create %s failed\n", s, name);
+      exit(1);
+    }
+    for(i = 0; i < N; i++){
+      ((int*)buf)[0] = j;
+      ((int*)buf)[1] = i;
+      if(write(fd, buf, BSIZE) != BSIZE){
+        printf("%s: write %s failed\n", s, name);
+        exit(1);
+      }
+    }
+    close(fd);
+  }
+
+  for(j = 0; j <= NR; j++){
+    name[1] = '0' + j;
+    if((pids[j] = fork()) < 0){
+      printf("%s: fork failed\n", s);
+      exit(1);
+    }
+    if(pids[j] == 0 && j == NR){
+      if((fd = open("iow", O_CREATE|O_RDWR)) < 0)
+        exit(1);
+      for(i = 0; i < N; i++){
+        ((int*)buf)[0] = i;
+        if(write(fd, buf, BSIZE) != BSIZE)
+          exit(1);
+      }
+      close(fd);
+      exit(0);
+    }
+    if(pids[j] == 0){
+      if((fd = open(name, O_RDONLY)) < 0)
+        exit(1);
+      for(i = 0; i < N; i++){
+        if(read(fd, buf, BSIZE) != BSIZE ||
+           ((int*)buf)[0] != j || ((int*)buf)[1] != i)
+          exit(1);
+      }
+      close(fd);
+      exit(0);
+    }
+  }
+
+  // a watchdog, in case one side never gets the disk.
+  if((dog = fork()) < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(dog == 0){
+    sleep(T);
+    exit(0);
+  }
+  for(i = 0; i <= NR; i++){
+    pid = wait(&xstatus);
+    if(pid == dog){
+      printf("%s: readers or writer starved\n", s);
+      for(j = 0; j <= NR; j++)
+        kill(pids[j]);
+      exit(1);
+    }
+    if(xstatus != 0){
+      printf("%s: %s failed\n", s, pid == pids[NR] ? "writer" : "reader");
+      exit(1);
+    }
+  }
+  kill(dog);
+  wait(0);
+
+  unlink("iow");
+  for(j = 0; j < NR; j++){
+    name[1] = '0' + j;
+    unlink(name);
+  }
+}
+
+// mmap a file shared and private, and check that only
+// shared writes reach the file, on munmap or exit.
+void
+mmapfile(char *s)
+{
+  enum { SZ = 2*4096 + 1000 };
+  char *file = "mmapfile";
+  char *p, *q;
+  int fd, i, pid, xstatus;
+
+  unlink(file);
+  fd = open(file, O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create %s failed\n", s, file);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 26;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+  q = mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1 || q == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + i % 26 || q[i] != 'a' + i % 26){
+      printf("%s: mapped contents wrong at %d\n", s, i);
+      exit(1);
+    }
+  }
+  // past EOF, the last page is zero.
+  if(p[SZ] != 0 || q[PGROUNDUP(SZ)-1] != 0){
+    printf("%s: page past EOF not zero\n", s);
+    exit(1);
+  }
+
+  p[0] = 'P';
+  q[1] = 'Q';
+  if(munmap(p, SZ) != 0 || munmap(q, 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  // a child writes the rest of the shared mapping and
+  // exits without unmapping it.
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    q[4096] = 'C';
+    q[2*4096 + 999] = 'D';
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  if(munmap(q + 4096, SZ - 4096) != 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  if(read(fd, buf, 1) != 0){
+    printf("%s: file grew\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open(file, O_RDONLY);
+  if(read(fd, buf, SZ+1) != SZ){
+    printf("%s: file size changed\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'a' || buf[1] != 'Q' || buf[4096] != 'C' || buf[2*4096 + 999] != 'D'){
+    printf("%s: shared writes not in file\n", s);
+    exit(1);
+  }
+
+  // a read-only file can't be mapped shared and writable.
+  if(mmap(0, SZ, PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: mmap of read-only file for writing succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink(file);
+}
+
+// program text is shared between processes and
+// must be read-only.
+void
+textwrite(char *s)
+{
+  int pid, xstatus, fd;
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    volatile int *addr = (int *) 0;
+    *addr = 10;
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != -1){
+    printf("%s: write to text succeeded\n", s);
+    exit(1);
+  }
+
+  // nor may the kernel write to it on our behalf.
+  fd = open("echo", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open echo failed\n", s);
+    exit(1);
+  }
+  if(read(fd, (char*)textwrite, 16) > 0){
+    printf("%s: read into text succeeded\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// fork a process using two thirds of physical memory.
+// only possible if fork shares pages copy-on-write.
+// also checks that writes, including writes by the
+// kernel via read(), don't leak between parent and child.
+void
+cowfork(char *s)
+{
+  int sz = ((PHYSTOP - KERNBASE) / 3) * 2;
+  char *a, *p;
+  int pid, xstatus, fds[2];
+
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(%d) failed\n", s, sz);
+    exit(1);
+  }
+  for(p = a; p < a + sz; p += 4096)
+    *(int*)p = 1;
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 3; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("%s: fork() failed\n", s);
+      exit(1);
+    }
+    if(pid == 0){
+      for(p = a; p < a + sz; p += 4096){
+        if(*(int*)p != 1){
+          printf("%s: child sees wrong value\n", s);
+          exit(1);
+        }
+      }
+      *(int*)a = 2;
+      if(read(fds[0], a + 4096, 4) != 4){
+        printf("%s: read failed\n", s);
+        exit(1);
+      }
+      exit(0);
+    }
+  }
+  if(write(fds[1], "xxxxxxxxxxxx", 12) != 12){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  for(int i = 0; i < 3; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  if(*(int*)a != 1 || *(int*)(a + 4096) != 1){
+    printf("%s: child write visible in parent\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+  if(sbrk(-sz) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-%d) failed\n", s, sz);
+    exit(1);
+  }
+}
+
 void
 sbrkmuch(char *s)
 {
@@ -2113,20 +2703,28 @@ sbrkfail(char *s)
   int pids[10];
   int pid;
  
-  if(pipe(fds) != 0){
-    printf("%s: pipe() failed\n", s);
-    exit(1);
-  }
   for(i = 0; i < sizeof(pids)/sizeof(pids[0]); i++){
+    if(pipe(fds) != 0){
+      printf("%s: pipe() failed\n", s);
+      exit(1);
+    }
     if((pids[i] = fork()) == 0){
-      // allocate a lot of memory
-      sbrk(BIG - (uint64)sbrk(0));
+      // allocate a lot of memory, and touch it, since sbrk
+      // is lazy. a child that runs out of memory is killed.
+      close(fds[0]);
+      a = sbrk(0);
+      sbrk(BIG - (uint64)a);
+      for(; a < (char*)BIG; a += PGSIZE)
+        *a = 1;
       write(fds[1], "x", 1);
       // sit around until killed
       for(;;) sleep(1000);
     }
+    close(fds[1]);
+    // reads nothing if the child was killed.
     if(pids[i] != -1)
       read(fds[0], &scratch, 1);
+    close(fds[0]);
   }
 
   // if those failed allocations freed up the pages they did allocate,
@@ -2142,6 +2740,7 @@ sbrkfail(char *s)
     printf("%s: failed sbrk leaked memory\n", s);
     exit(1);
   }
+  *c = 1;  // faults in the page, now that the children are gone
 
   // test running fork with the above allocated page 
   pid = fork();
@@ -2170,6 +2769,50 @@ sbrkfail(char *s)
 }
 
   
+// sbrk only reserves address space; pages appear on first
+// touch, whether by the program or by a system call.
+void
+sbrklazy(char *s)
+{
+  enum { HUGE=1024*1024*1024 };
+  char *a;
+  int fds[2];
+
+  a = sbrk(HUGE);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk of unused address space failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  a[HUGE/2] = 2;
+  a[HUGE-1] = 3;
+  if(a[0] != 1 || a[HUGE/2] != 2 || a[HUGE-1] != 3 || a[HUGE/4] != 0){
+    printf("%s: lazily allocated memory has wrong contents\n", s);
+    exit(1);
+  }
+
+  // system calls that copy in from or out to untouched pages.
+  if(pipe(fds) != 0){
+    printf("%s: pipe() failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], a + 3*(HUGE/4), 10) != 10){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], a + HUGE/8, 10) != 10 || a[HUGE/8] != 0){
+    printf("%s: read into untouched page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(sbrk(-HUGE) == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk(-HUGE) failed\n", s);
+    exit(1);
+  }
+}
+
 // test reads/writes from/to allocated memory
 void
 sbrkarg(char *s)
@@ -2663,6 +3306,7 @@ main(int argc, char *argv[])
     {unlinkread, "unlinkread"},
     {concreate, "concreate"},
     {subdir, "subdir"},
+    {dcache, "dcache"},
     {fourfiles, "fourfiles"},
     {sharedfd, "sharedfd"},
     {exectest, "exectest"},
@@ -2671,6 +3315,13 @@ main(int argc, char *argv[])
     {bsstest, "bsstest"},
     {sbrkbasic, "sbrkbasic"},
     {sbrkmuch, "sbrkmuch"},
+    {pagecache, "pagecache"},
+    {writeback, "writeback"},
+    {iosched, "iosched"},
+    {mmapfile, "mmapfile"},
+    {textwrite, "textwrite"},
+    {cowfork, "cowfork"},
+    {sbrklazy, "sbrklazy"},
     {kernmem, "kernmem"},
     {sbrkfail, "sbrkfail"},
     {sbrkarg, "sbrkarg"},
@@ -2694,6 +3345,8 @@ main(int argc, char *argv[])
     {iref, "iref"},
     {forktest, "forktest"},
     {bigdir, "bigdir"}, // slow
+    {hashdir, "hashdir"}, // slow
+    {fragfile, "fragfile"}, // slow
     { 0, 0},
   };
 